@@ -54,6 +54,8 @@ static bool cmd_targets(void);
 static bool cmd_morse(void);
 static bool cmd_connect_srst(target *t, int argc, const char **argv);
 static bool cmd_hard_srst(void);
+static bool cmd_flash_incremental(target *t, int argc, const char **argv);
+
 #ifdef PLATFORM_HAS_POWER_SWITCH
 static bool cmd_target_power(target *t, int argc, const char **argv);
 #endif
@@ -63,6 +65,9 @@ static bool cmd_traceswo(void);
 #ifdef PLATFORM_HAS_DEBUG
 static bool cmd_debug_bmp(target *t, int argc, const char **argv);
 #endif
+#ifdef PLATFORM_HAS_FREQUENCY
+static bool cmd_freq(target *t, int argc, const char **argv);
+#endif
 
 #ifdef PLATFORM_HAS_COMMANDS
 #define PLATFORM_COMMANDS_DEFINE
@@ -80,6 +85,7 @@ const struct command_s cmd_list[] = {
 	{"morse", (cmd_handler)cmd_morse, "Display morse error message" },
 	{"connect_srst", (cmd_handler)cmd_connect_srst, "Configure connect under SRST: (enable|disable)" },
 	{"hard_srst", (cmd_handler)cmd_hard_srst, "Force a pulse on the hard SRST line - disconnects target" },
+	{"flash_incremental", (cmd_handler)cmd_flash_incremental, "Skip erasing and writing unchanged flash blocks, staging them in target RAM: (enable|disable)" },
 #ifdef PLATFORM_HAS_POWER_SWITCH
 	{"tpwr", (cmd_handler)cmd_target_power, "Supplies power to the target: (enable|disable)"},
 #endif
@@ -89,6 +95,9 @@ const struct command_s cmd_list[] = {
 #ifdef PLATFORM_HAS_DEBUG
 	{"debug_bmp", (cmd_handler)cmd_debug_bmp, "Output BMP \"debug\" strings to the second vcom: (enable|disable)"},
 #endif
+#ifdef PLATFORM_HAS_FREQUENCY
+	{"freq", (cmd_handler)cmd_freq, "Set max SWCLK/TCK frequency: (<Hz>[k|M]|auto), auto tunes it down on swdp_scan" },
+#endif
 #ifdef PLATFORM_HAS_COMMANDS
 #define PLATFORM_COMMANDS_LIST
 #include <platform_commands.h>
@@ -234,6 +243,11 @@ bool cmd_swdp_scan(void)
 		gdb_out("SW-DP scan failed!\n");
 		return false;
 	}
+#ifdef PLATFORM_HAS_FREQUENCY
+	if (swdp_autotune_freq)
+		gdb_outf("SWCLK frequency: %"PRIu32" Hz\n",
+			 platform_max_frequency_get());
+#endif
 
 	cmd_targets();
 	morse(NULL, false);
@@ -285,6 +299,23 @@ static bool cmd_hard_srst(void)
 	return true;
 }
 
+static bool cmd_flash_incremental(target *t, int argc, const char **argv)
+{
+	(void)t;
+	if (argc == 1) {
+		gdb_outf("Incremental flashing: %s\n",
+			 target_flash_incremental ? "enabled" : "disabled");
+	} else if (!strcmp(argv[1], "enable")) {
+		target_flash_incremental = true;
+	} else if (!strcmp(argv[1], "disable")) {
+		target_flash_incremental = false;
+	} else {
+		gdb_outf("usage: monitor flash_incremental (enable|disable)\n");
+		return false;
+	}
+	return true;
+}
+
 #ifdef PLATFORM_HAS_POWER_SWITCH
 static bool cmd_target_power(target *t, int argc, const char **argv)
 {
@@ -321,6 +352,49 @@ static bool cmd_debug_bmp(target *t, int argc, const char **argv)
 }
 #endif
 
+#ifdef PLATFORM_HAS_FREQUENCY
+static bool cmd_freq(target *t, int argc, const char **argv)
+{
+	(void)t;
+	if (argc > 1) {
+		if (!strcmp(argv[1], "auto")) {
+			/* Tune down from the current setting */
+			swdp_autotune_freq = platform_max_frequency_get();
+		} else {
+			char *end;
+			uint32_t mult = 1;
+			/* 64 bits wide, so any overflow also exceeds 32 bits */
+			unsigned long long freq = strtoull(argv[1], &end, 0);
+			if ((*end == 'k') || (*end == 'K')) {
+				mult = 1000;
+				end++;
+			} else if (*end == 'M') {
+				mult = 1000000;
+				end++;
+			}
+			/* Reject a missing number, anything after the suffix,
+			 * zero and values that don't fit in 32 bits */
+			if ((argv[1][0] < '0') || (argv[1][0] > '9') || *end ||
+			    !freq || (freq > UINT32_MAX / mult)) {
+				gdb_outf("usage: monitor freq (<Hz>[k|M]|auto)\n");
+				return false;
+			}
+			swdp_autotune_freq = 0;
+			platform_max_frequency_set(freq * mult);
+		}
+	}
+#ifdef PLATFORM_FREQUENCY_ESTIMATED
+	const char *estimated = " (estimated)";
+#else
+	const char *estimated = "";
+#endif
+	gdb_outf("Max SWJ frequency: %"PRIu32" Hz%s%s\n",
+		 platform_max_frequency_get(), estimated,
+		 swdp_autotune_freq ? ", auto-tuned on scan" : "");
+	return true;
+}
+#endif
+
 #ifdef PLATFORM_HAS_COMMANDS
 #define PLATFORM_COMMANDS_CODE
 #include <platform_commands.h>
@@ -99,6 +99,9 @@ uint32_t generic_crc32(target *t, uint32_t base, size_t len)
 	uint32_t crc = -1;
 	uint8_t bytes[128];
 
+	if (target_mem_crc32(t, base, len, &crc))
+		return crc;
+
 	while (len) {
 		size_t read_len = MIN(sizeof(bytes), len);
 		target_mem_read(t, bytes, base, read_len);
@@ -111,13 +114,41 @@ uint32_t generic_crc32(target *t, uint32_t base, size_t len)
 	}
 	return crc;
 }
+
+/* CRC of len bytes of value, such as a blank flash block */
+uint32_t crc32_fill(uint8_t value, size_t len)
+{
+	uint32_t crc = -1;
+
+	while (len--)
+		crc = crc32_calc(crc, value);
+	return crc;
+}
 #else
 #include <libopencm3/stm32/crc.h>
+/* Finish a hardware CRC with the bytes that don't fill a word */
+static uint32_t crc32_tail(uint32_t crc, const uint8_t *data, size_t len)
+{
+	while (len--) {
+		crc ^= *data++ << 24;
+		for (int i = 0; i < 8; i++) {
+			if (crc & 0x80000000)
+				crc = (crc << 1) ^ 0x4C11DB7;
+			else
+				crc <<= 1;
+		}
+	}
+	return crc;
+}
+
 uint32_t generic_crc32(target *t, uint32_t base, size_t len)
 {
 	uint8_t bytes[128];
 	uint32_t crc;
 
+	if (target_mem_crc32(t, base, len, &crc))
+		return crc;
+
 	CRC_CR |= CRC_CR_RESET;
 
 	while (len > 3) {
@@ -134,17 +165,19 @@ uint32_t generic_crc32(target *t, uint32_t base, size_t len)
 	crc = CRC_DR;
 
 	target_mem_read(t, bytes, base, len);
-	uint8_t *data = bytes;
-	while (len--) {
-		crc ^= *data++ << 24;
-		for (int i = 0; i < 8; i++) {
-			if (crc & 0x80000000)
-				crc = (crc << 1) ^ 0x4C11DB7;
-			else
-				crc <<= 1;
-		}
-	}
-	return crc;
+	return crc32_tail(crc, bytes, len);
+}
+
+uint32_t crc32_fill(uint8_t value, size_t len)
+{
+	const uint8_t tail[3] = {value, value, value};
+
+	CRC_CR |= CRC_CR_RESET;
+
+	for (; len > 3; len -= 4)
+		CRC_DR = value * 0x01010101;
+
+	return crc32_tail(CRC_DR, tail, len);
 }
 #endif
 
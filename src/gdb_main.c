@@ -34,6 +34,7 @@
 #include "command.h"
 #include "crc32.h"
 #include "morse.h"
+#include "exception.h"
 
 enum gdb_signal {
 	GDB_SIGINT = 2,
@@ -42,11 +43,18 @@ enum gdb_signal {
 	GDB_SIGLOST = 29,
 };
 
-#define BUF_SIZE	1024
+/* Largest packet we accept, advertised to GDB as PacketSize.
+ * Platforms with RAM to spare can raise it to save round trips. */
+#ifndef GDB_PACKET_BUFFER_SIZE
+#define GDB_PACKET_BUFFER_SIZE	1024
+#endif
+#define BUF_SIZE	GDB_PACKET_BUFFER_SIZE
 
 #define ERROR_IF_NO_TARGET()	\
 	if(!cur_target) { gdb_putpacketz("EFF"); break; }
 
+/* Packets are received into and mostly answered from this buffer, large
+ * replies are built in place rather than on the GDB thread's stack. */
 static char pbuf[BUF_SIZE+1];
 
 static target *cur_target;
@@ -55,6 +63,12 @@ static target *last_target;
 static void handle_q_packet(char *packet, int len);
 static void handle_v_packet(char *packet, int len);
 static void handle_z_packet(char *packet, int len);
+static void handle_vcont(const char *actions);
+
+/* GDB register number of the PC on ARM */
+#define GDB_REG_PC	15
+/* Range stepping checks for a ^C from GDB once every that many steps */
+#define RANGE_STEP_POLL	32
 
 static void gdb_target_destroy_callback(struct target_controller *tc, target *t)
 {
@@ -91,20 +105,166 @@ static struct target_controller gdb_controller = {
 	.system = hostio_system,
 };
 
+#ifdef PLATFORM_HAS_GDB_SESSIONS
+/* Monitor sessions may only read the memory of the debug session's
+ * target.  They are served on this thread between debug packets and
+ * while the target runs, so the DP never sees two users at once. */
+#define MON_BUF_SIZE	256
+static char mon_buf[MON_BUF_SIZE+1];
+static int debug_link;
+
+static void handle_monitor_packet(char *packet)
+{
+	uint32_t addr, len;
+
+	switch (packet[0]) {
+	case 'm':	/* 'm addr,len': Read len bytes from addr */
+	case 'x':	/* 'x addr,len': Read len bytes from addr as binary */
+		if (!cur_target) {
+			gdb_putpacketz("EFF");
+			break;
+		}
+		if (sscanf(packet + 1, "%" SCNx32 ",%" SCNx32, &addr, &len) != 2) {
+			gdb_putpacketz("E02");
+			break;
+		}
+		/* Read everything before the reply starts, a fault while
+		 * reading must not land in the middle of a packet. */
+		if (packet[0] == 'x') {
+			len = MIN(len, MON_BUF_SIZE - 1);
+			if (target_mem_read(cur_target, packet + 1, addr, len)) {
+				gdb_putpacketz("E01");
+			} else {
+				packet[0] = 'b';
+				gdb_putpacket(packet, len + 1);
+			}
+		} else if (len > MON_BUF_SIZE / 2) {
+			gdb_putpacketz("E02");
+		} else if (target_mem_read(cur_target, packet + len, addr, len)) {
+			gdb_putpacketz("E01");
+		} else {
+			gdb_putpacket(hexify(packet, packet + len, len), len * 2);
+		}
+		break;
+
+	case 'q':	/* General query packet */
+		if (!strncmp(packet, "qSupported", 10))
+			gdb_putpacket_f("PacketSize=%X", MON_BUF_SIZE);
+		else
+			gdb_putpacketz("");
+		break;
+
+	case 0x04:	/* Link closed */
+		break;
+
+	default:	/* Anything else belongs to the debug session */
+		gdb_putpacketz("");
+	}
+}
+
+/* Answer one packet from each monitor session that sent a whole one.
+ * Nothing here may wait on a monitor link: the packet is already
+ * buffered, a bad one is NAKed for GDB to resend on a later poll, and
+ * replies are sent without waiting for their ack. */
+static void gdb_monitor_poll(void)
+{
+	for (int link = 0; link < GDB_IF_LINKS; link++) {
+		if ((link == debug_link) || !gdb_if_packet_pending(link))
+			continue;
+
+		bool noack = gdb_set_noackmode(true);
+		gdb_if_select(link);
+		int size = gdb_if_read_packet(mon_buf, MON_BUF_SIZE);
+		if (size == GDB_IF_PACKET_BAD) {
+			gdb_if_putchar('-', 1);
+		} else if (size >= 0) {
+			gdb_if_putchar('+', 1);
+			mon_buf[size] = 0;
+			volatile struct exception e;
+			TRY_CATCH(e, EXCEPTION_ALL) {
+				handle_monitor_packet(mon_buf);
+			}
+			if (e.type)
+				gdb_putpacketz("EFF");
+		}
+		gdb_if_select(debug_link);
+		gdb_set_noackmode(noack);
+	}
+}
+
+/* Serve monitor sessions until the debug session sends a packet.  The
+ * debug link only changes while no target is attached.  If it closes
+ * with a target attached, gdb_getpacket() reports that as a detach. */
+static void gdb_session_wait(void)
+{
+	while (1) {
+		if (!cur_target)
+			debug_link = gdb_if_debug_link();
+		gdb_if_select(debug_link);
+		if (gdb_if_pending(debug_link) ||
+		    (cur_target && !gdb_if_connected(debug_link)))
+			return;
+		gdb_monitor_poll();
+		gdb_if_wait(10);
+	}
+}
+#endif
+
+static bool gdb_interrupted(void)
+{
+	unsigned char c = gdb_if_getchar_to(0);
+	return (c == '\x03') || (c == '\x04');
+}
+
+static enum target_halt_reason gdb_halt_wait(target *t, target_addr *watch)
+{
+	enum target_halt_reason reason;
+
+	/* Wait for target halt */
+	while(!(reason = target_halt_poll(t, watch))) {
+		if(gdb_interrupted()) {
+			target_halt_request(t);
+		}
+#ifdef PLATFORM_HAS_GDB_SESSIONS
+		gdb_monitor_poll();
+#endif
+	}
+	return reason;
+}
+
+static void gdb_halt_report(enum target_halt_reason reason, target_addr watch)
+{
+	/* Translate reason to GDB signal */
+	switch (reason) {
+	case TARGET_HALT_ERROR:
+		gdb_putpacket_f("X%02X", GDB_SIGLOST);
+		morse("TARGET LOST.", true);
+		break;
+	case TARGET_HALT_REQUEST:
+		gdb_putpacket_f("T%02X", GDB_SIGINT);
+		break;
+	case TARGET_HALT_WATCHPOINT:
+		gdb_putpacket_f("T%02Xwatch:%08X;", GDB_SIGTRAP, watch);
+		break;
+	case TARGET_HALT_FAULT:
+		gdb_putpacket_f("T%02X", GDB_SIGSEGV);
+		break;
+	default:
+		gdb_putpacket_f("T%02X", GDB_SIGTRAP);
+	}
+}
+
 int gdb_main_loop(struct target_controller *tc, bool in_syscall)
 {
 	int size;
 	bool single_step = false;
-#ifdef EPUCK2_CHIBIOS
-	systime_t time;
-#endif /* EPUCK2_CHIBIOS */
 
 	/* GDB protocol main loop */
 	while(1) {
-#ifdef EPUCK2_CHIBIOS
-		time = chVTGetSystemTime();
-#endif /* EPUCK2_CHIBIOS */
 		SET_IDLE_STATE(1);
+#ifdef PLATFORM_HAS_GDB_SESSIONS
+		gdb_session_wait();
+#endif
 		size = gdb_getpacket(pbuf, BUF_SIZE);
 		SET_IDLE_STATE(0);
 		switch(pbuf[0]) {
@@ -121,12 +281,14 @@ int gdb_main_loop(struct target_controller *tc, bool in_syscall)
 			uint32_t addr, len;
 			ERROR_IF_NO_TARGET();
 			sscanf(pbuf, "m%" SCNx32 ",%" SCNx32, &addr, &len);
-			if (len > sizeof(pbuf) / 2) {
+			if (len > BUF_SIZE / 2) {
 				gdb_putpacketz("E02");
 				break;
 			}
 			DEBUG("m packet: addr = %" PRIx32 ", len = %" PRIx32 "\n", addr, len);
-			uint8_t mem[len];
+			/* Read into the upper half and hexify down over it, each
+			 * byte is consumed before its hex digits overwrite it. */
+			uint8_t *mem = (uint8_t *)pbuf + len;
 			if (target_mem_read(cur_target, mem, addr, len))
 				gdb_putpacketz("E01");
 			else
@@ -141,6 +303,41 @@ int gdb_main_loop(struct target_controller *tc, bool in_syscall)
 			gdb_putpacketz("OK");
 			break;
 			}
+		case 'p': { /* 'p n': Read register n */
+			uint32_t reg;
+			uint8_t val[8];
+			ERROR_IF_NO_TARGET();
+			sscanf(pbuf, "p%" SCNx32, &reg);
+			int len = target_reg_read(cur_target, reg, val, sizeof(val));
+			if (len > 0)
+				gdb_putpacket(hexify(pbuf, val, len), len * 2);
+			else if (len == 0) /* GDB falls back to 'g' */
+				gdb_putpacketz("");
+			else
+				gdb_putpacketz("E01");
+			break;
+			}
+		case 'P': { /* 'P n=XX': Write register n */
+			uint32_t reg;
+			uint8_t val[8];
+			int hex = 0;
+			ERROR_IF_NO_TARGET();
+			sscanf(pbuf, "P%" SCNx32 "=%n", &reg, &hex);
+			if (!hex) {
+				gdb_putpacketz("E02");
+				break;
+			}
+			size_t len = MIN((size - hex) / 2, (int)sizeof(val));
+			unhexify(val, pbuf + hex, len);
+			int ret = target_reg_write(cur_target, reg, val, len);
+			if (ret > 0)
+				gdb_putpacketz("OK");
+			else if (ret == 0)
+				gdb_putpacketz("");
+			else
+				gdb_putpacketz("E01");
+			break;
+			}
 		case 'M': { /* 'M addr,len:XX': Write len bytes to addr */
 			uint32_t addr, len;
 			int hex;
@@ -151,9 +348,9 @@ int gdb_main_loop(struct target_controller *tc, bool in_syscall)
 				break;
 			}
 			DEBUG("M packet: addr = %" PRIx32 ", len = %" PRIx32 "\n", addr, len);
-			uint8_t mem[len];
-			unhexify(mem, pbuf + hex, len);
-			if (target_mem_write(cur_target, addr, mem, len))
+			/* Decode in place, the output never overtakes the input */
+			unhexify(pbuf, pbuf + hex, len);
+			if (target_mem_write(cur_target, addr, pbuf, len))
 				gdb_putpacketz("E01");
 			else
 				gdb_putpacketz("OK");
@@ -184,33 +381,9 @@ int gdb_main_loop(struct target_controller *tc, bool in_syscall)
 				break;
 			}
 
-			/* Wait for target halt */
-			while(!(reason = target_halt_poll(cur_target, &watch))) {
-				unsigned char c = gdb_if_getchar_to(0);
-				if((c == '\x03') || (c == '\x04')) {
-					target_halt_request(cur_target);
-				}
-			}
+			reason = gdb_halt_wait(cur_target, &watch);
 			SET_RUN_STATE(0);
-
-			/* Translate reason to GDB signal */
-			switch (reason) {
-			case TARGET_HALT_ERROR:
-				gdb_putpacket_f("X%02X", GDB_SIGLOST);
-				morse("TARGET LOST.", true);
-				break;
-			case TARGET_HALT_REQUEST:
-				gdb_putpacket_f("T%02X", GDB_SIGINT);
-				break;
-			case TARGET_HALT_WATCHPOINT:
-				gdb_putpacket_f("T%02Xwatch:%08X;", GDB_SIGTRAP, watch);
-				break;
-			case TARGET_HALT_FAULT:
-				gdb_putpacket_f("T%02X", GDB_SIGSEGV);
-				break;
-			default:
-				gdb_putpacket_f("T%02X", GDB_SIGTRAP);
-			}
+			gdb_halt_report(reason, watch);
 			break;
 			}
 		case 'F':	/* Semihosting call finished */
@@ -264,6 +437,19 @@ int gdb_main_loop(struct target_controller *tc, bool in_syscall)
 			}
 			break;
 
+		case 'x': { /* 'x addr,len': Read len bytes from addr as binary */
+			uint32_t addr, len;
+			ERROR_IF_NO_TARGET();
+			if (sscanf(pbuf, "x%" SCNx32 ",%" SCNx32, &addr, &len) != 2) {
+				gdb_putpacketz("E02");
+				break;
+			}
+			DEBUG("x packet: addr = %" PRIx32 ", len = %" PRIx32 "\n", addr, len);
+			if (!gdb_putpacket_mem('b', cur_target, addr, len))
+				gdb_putpacketz("E01");
+			break;
+			}
+
 		case 'X': { /* 'X addr,len:XX': Write binary data to addr */
 			uint32_t addr, len;
 			int bin;
@@ -285,6 +471,16 @@ int gdb_main_loop(struct target_controller *tc, bool in_syscall)
 			handle_q_packet(pbuf, size);
 			break;
 
+		case 'Q':	/* General set packet */
+			if (!strcmp(pbuf, "QStartNoAckMode")) {
+				/* GDB still acks this reply */
+				gdb_putpacketz("OK");
+				gdb_set_noackmode(true);
+			} else {
+				gdb_putpacketz("");
+			}
+			break;
+
 		case 'v':	/* General query packet */
 			handle_v_packet(pbuf, size);
 			break;
@@ -300,10 +496,6 @@ int gdb_main_loop(struct target_controller *tc, bool in_syscall)
 			DEBUG("*** Unsupported packet: %s\n", pbuf);
 			gdb_putpacketz("");
 		}
-
-#ifdef EPUCK2_CHIBIOS
-		chThdSleepUntilWindowed(time, time + TIME_MS2I(1));
-#endif /* EPUCK2_CHIBIOS */
 	}
 }
 
@@ -317,12 +509,14 @@ handle_q_string_reply(const char *str, const char *param)
 		return;
 	}
 	if (addr < strlen (str)) {
-		char reply[len+2];
-		reply[0] = 'm';
-		strncpy (reply + 1, &str[addr], len);
+		/* param has been parsed, build the reply in pbuf */
+		if(len > BUF_SIZE - 1)
+			len = BUF_SIZE - 1;
 		if(len > strlen(&str[addr]))
 			len = strlen(&str[addr]);
-		gdb_putpacket(reply, len + 1);
+		pbuf[0] = 'm';
+		memcpy(pbuf + 1, &str[addr], len);
+		gdb_putpacket(pbuf, len + 1);
 	} else if (addr == strlen (str)) {
 		gdb_putpacketz("l");
 	} else
@@ -354,8 +548,12 @@ handle_q_packet(char *packet, int len)
 			gdb_putpacketz("E");
 
 	} else if (!strncmp (packet, "qSupported", 10)) {
-		/* Query supported protocol features */
-		gdb_putpacket_f("PacketSize=%X;qXfer:memory-map:read+;qXfer:features:read+", BUF_SIZE);
+		/* Query supported protocol features.  GDB starts every
+		 * session with this in ack mode, a previous session may have
+		 * gone without a detach we could see. */
+		if (gdb_set_noackmode(false))
+			gdb_if_putchar('+', 1);
+		gdb_putpacket_f("PacketSize=%X;qXfer:memory-map:read+;qXfer:features:read+;binary-upload+;QStartNoAckMode+", BUF_SIZE);
 
 	} else if (strncmp (packet, "qXfer:memory-map:read::", 23) == 0) {
 		/* Read target XML memory map */
@@ -427,6 +625,13 @@ handle_v_packet(char *packet, int plen)
 
 		} else	gdb_putpacketz("E01");
 
+	} else if (!strcmp(packet, "vCont?")) {
+		/* GDB won't use vCont unless c, C, s and S are all there */
+		gdb_putpacketz("vCont;c;C;s;S;r");
+
+	} else if (!strncmp(packet, "vCont;", 6)) {
+		handle_vcont(packet + 6);
+
 	} else if (sscanf(packet, "vFlashErase:%08lx,%08lx", &addr, &len) == 2) {
 #ifdef EPUCK2_CHIBIOS
 		SET_PROGRAMMING_STATE();
@@ -473,6 +678,62 @@ handle_v_packet(char *packet, int plen)
 	}
 }
 
+/* We only have one thread, so only the first action matters.  Signals
+ * for C and S are ignored as they are for c and s. */
+static void
+handle_vcont(const char *actions)
+{
+	uint32_t start = 0, end = 0, pc;
+	unsigned steps = 0;
+	target_addr watch;
+	enum target_halt_reason reason;
+
+	if(!cur_target) {
+		gdb_putpacketz("X1D");
+		return;
+	}
+
+	switch (actions[0]) {
+	case 'c':
+	case 'C':
+		target_halt_resume(cur_target, false);
+		SET_RUN_STATE(1);
+		reason = gdb_halt_wait(cur_target, &watch);
+		break;
+	case 'r':	/* 'r start,end': Step while start <= pc < end */
+		if (sscanf(actions, "r%" SCNx32 ",%" SCNx32, &start, &end) != 2) {
+			gdb_putpacketz("E02");
+			return;
+		}
+		/* fall through */
+	case 's':
+	case 'S':
+		/* Stepping through the range here saves GDB a round trip
+		 * per instruction.  Stopping early is allowed, so a target
+		 * that can't give us its PC just steps once. */
+		SET_RUN_STATE(1);
+		do {
+			target_halt_resume(cur_target, true);
+			reason = gdb_halt_wait(cur_target, &watch);
+			if (reason != TARGET_HALT_STEPPING)
+				break;
+			if (target_reg_read(cur_target, GDB_REG_PC, &pc,
+			                    sizeof(pc)) != sizeof(pc))
+				break;
+			if ((++steps % RANGE_STEP_POLL == 0) && gdb_interrupted()) {
+				reason = TARGET_HALT_REQUEST;
+				break;
+			}
+		} while ((pc >= start) && (pc < end));
+		break;
+	default:
+		gdb_putpacketz("");
+		return;
+	}
+	SET_RUN_STATE(0);
+	gdb_halt_report(reason, watch);
+}
+
 static void
 handle_z_packet(char *packet, int plen)
 {
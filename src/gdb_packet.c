@@ -26,20 +26,56 @@
 #include "gdb_if.h"
 #include "gdb_packet.h"
 #include "hex_utils.h"
+#include "target.h"
 
 #include <stdarg.h>
 
+/* Target memory is read this many bytes at a time by gdb_putpacket_mem() */
+#define GDB_MEM_CHUNK	64
+
+/* Outgoing packets are escaped into this buffer, which is passed to
+ * gdb_if_write() each time it fills.  A multiple of the USB packet size. */
+#define GDB_TX_SIZE	512
+static uint8_t tx_buf[GDB_TX_SIZE];
+static int tx_len;
+
+/* Set once GDB agreed to QStartNoAckMode, packets are then neither acked
+ * nor resent.  A new connection starts in ack mode again. */
+static bool noackmode;
+
+bool gdb_set_noackmode(bool enable)
+{
+	bool was = noackmode;
+	noackmode = enable;
+	return was;
+}
+
 int gdb_getpacket(char *packet, int size)
 {
 	unsigned char c;
+	int i;
+
+#ifdef PLATFORM_HAS_GDB_IF_READ_PACKET
+	while((i = gdb_if_read_packet(packet, size)) == GDB_IF_PACKET_BAD)
+		if(!noackmode)
+			gdb_if_putchar('-', 1); /* send nack */
+
+	if(i == GDB_IF_PACKET_DETACH) {
+		noackmode = false;
+		packet[0] = 0x04;
+		return 1;
+	}
+#else
 	unsigned char csum;
 	char recv_csum[3];
-	int i;
 
 	while(1) {
 		/* Wait for packet start */
 		while((packet[0] = gdb_if_getchar()) != '$')
-			if(packet[0] == 0x04) return 1;
+			if(packet[0] == 0x04) {
+				noackmode = false;
+				return 1;
+			}
 
 		i = 0; csum = 0;
 		/* Capture packet data into buffer */
@@ -69,9 +105,12 @@ int gdb_getpacket(char *packet, int size)
 		if(csum == strtol(recv_csum, NULL, 16)) break;
 
 		/* get here if checksum fails */
-		gdb_if_putchar('-', 1); /* send nack */
+		if(!noackmode)
+			gdb_if_putchar('-', 1); /* send nack */
 	}
-	gdb_if_putchar('+', 1); /* send ack */
+#endif
+	if(!noackmode)
+		gdb_if_putchar('+', 1); /* send ack */
 	packet[i] = 0;
 
 #ifdef DEBUG_GDBPACKET
@@ -88,12 +127,73 @@ int gdb_getpacket(char *packet, int size)
 	return i;
 }
 
+static void gdb_putpacket_start(void)
+{
+	tx_buf[0] = '$';
+	tx_len = 1;
+}
+
+/* Escape len bytes into tx_buf, adding them to the checksum */
+static void gdb_put_escaped(const uint8_t *data, size_t len,
+                            unsigned char *csum)
+{
+	unsigned char sum = *csum;
+
+	while (len--) {
+		uint8_t c = *data++;
+#ifdef DEBUG_GDBPACKET
+		if ((c >= 32) && (c < 127))
+			DEBUG("%c", c);
+		else
+			DEBUG("\\x%02X", c);
+#endif
+		if (tx_len > GDB_TX_SIZE - 2) {
+			gdb_if_write(tx_buf, tx_len, 0);
+			tx_len = 0;
+		}
+		/* '*' would start a run-length encoded sequence */
+		if((c == '$') || (c == '#') || (c == '}') || (c == '*')) {
+			tx_buf[tx_len++] = '}';
+			sum += '}';
+			c ^= 0x20;
+		}
+		tx_buf[tx_len++] = c;
+		sum += c;
+	}
+	*csum = sum;
+}
+
+static bool gdb_putpacket_end(unsigned char csum)
+{
+	static const char hex[] = "0123456789ABCDEF";
+
+	if (tx_len > GDB_TX_SIZE - 3) {
+		gdb_if_write(tx_buf, tx_len, 0);
+		tx_len = 0;
+	}
+	tx_buf[tx_len++] = '#';
+	tx_buf[tx_len++] = hex[csum >> 4];
+	tx_buf[tx_len++] = hex[csum & 0xf];
+	gdb_if_write(tx_buf, tx_len, 1);
+	tx_len = 0;
+#ifdef DEBUG_GDBPACKET
+	DEBUG("\n");
+#endif
+	if(noackmode)
+		return true;
+	return gdb_if_getchar_to(2000) == '+';
+}
+
+void __attribute__((weak))
+gdb_if_write(const uint8_t *buf, int len, int flush)
+{
+	for (int i = 0; i < len; i++)
+		gdb_if_putchar(buf[i], flush && (i == len - 1));
+}
+
 void gdb_putpacket(const char *packet, int size)
 {
-	int i;
 	unsigned char csum;
-	unsigned char c;
-	char xmit_csum[3];
 	int tries = 0;
 
 	do {
@@ -101,32 +201,44 @@ void gdb_putpacket(const char *packet, int size)
 		DEBUG("%s : ", __func__);
 #endif
 		csum = 0;
-		gdb_if_putchar('$', 0);
-		for(i = 0; i < size; i++) {
-			c = packet[i];
+		gdb_putpacket_start();
+		gdb_put_escaped((const uint8_t *)packet, size, &csum);
+	} while(!gdb_putpacket_end(csum) && (tries++ < 3));
+}
+
+/* Send prefix followed by len bytes of target memory as escaped binary.
+ * The memory is read in small chunks while the packet goes out, and read
+ * again if the packet has to be resent.  A read error after the first
+ * chunk ends the packet early, which GDB accepts as a short read.
+ * Returns false without sending anything if the first chunk fails.
+ */
+bool gdb_putpacket_mem(char prefix, target *t, target_addr addr, size_t len)
+{
+	uint8_t chunk[GDB_MEM_CHUNK];
+	size_t n = MIN(len, sizeof(chunk));
+	unsigned char csum;
+	int tries = 0;
+
+	if (target_mem_read(t, chunk, addr, n))
+		return false;
+
+	do {
 #ifdef DEBUG_GDBPACKET
-			if ((c >= 32) && (c < 127))
-				DEBUG("%c", c);
-			else
-				DEBUG("\\x%02X", c);
+		DEBUG("%s : ", __func__);
 #endif
-			if((c == '$') || (c == '#') || (c == '}')) {
-				gdb_if_putchar('}', 0);
-				gdb_if_putchar(c ^ 0x20, 0);
-				csum += '}' + (c ^ 0x20);
-			} else {
-				gdb_if_putchar(c, 0);
-				csum += c;
-			}
+		csum = 0;
+		gdb_putpacket_start();
+		gdb_put_escaped((const uint8_t *)&prefix, 1, &csum);
+		for (size_t i = 0; i < len; i += n) {
+			n = MIN(len - i, sizeof(chunk));
+			/* The first chunk is already there on the first try */
+			if ((i || tries) && target_mem_read(t, chunk, addr + i, n))
+				break;
+			gdb_put_escaped(chunk, n, &csum);
 		}
-		gdb_if_putchar('#', 0);
-		sprintf(xmit_csum, "%02X", csum);
-		gdb_if_putchar(xmit_csum[0], 0);
-		gdb_if_putchar(xmit_csum[1], 1);
-#ifdef DEBUG_GDBPACKET
-		DEBUG("\n");
-#endif
-	} while((gdb_if_getchar_to(2000) != '+') && (tries++ < 3));
+	} while(!gdb_putpacket_end(csum) && (tries++ < 3));
+
+	return true;
 }
 
 void gdb_putpacket_f(const char *fmt, ...)
@@ -21,6 +21,7 @@
 #ifndef __CRC32_H
 #define __CRC32_H
 
-uint32_t generic_crc32(target *t, uint32_t base, int len);
+uint32_t generic_crc32(target *t, uint32_t base, size_t len);
+uint32_t crc32_fill(uint8_t value, size_t len);
 
 #endif
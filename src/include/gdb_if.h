@@ -30,6 +30,27 @@ int gdb_if_init(void);
 unsigned char gdb_if_getchar(void);
 unsigned char gdb_if_getchar_to(int timeout);
 void gdb_if_putchar(unsigned char c, int flush);
+/* Send len bytes as if by gdb_if_putchar(), platforms may override the
+ * generic version to hand the whole buffer to their transport at once */
+void gdb_if_write(const uint8_t *buf, int len, int flush);
+
+/* Platforms defining PLATFORM_HAS_GDB_IF_READ_PACKET receive a whole
+ * packet at once: the unescaped payload of the next $...#xx is stored in
+ * packet and its length returned, or one of the codes below. */
+#define GDB_IF_PACKET_BAD	-1	/* checksum mismatch, send a NAK */
+#define GDB_IF_PACKET_DETACH	-2	/* the port was closed */
+int gdb_if_read_packet(char *packet, int size);
+
+/* Platforms defining PLATFORM_HAS_GDB_SESSIONS have GDB_IF_LINKS links.
+ * One carries the debug session, the others read only monitor sessions.
+ * The calls above act on the link chosen with gdb_if_select(). */
+void gdb_if_select(int link);
+int gdb_if_debug_link(void);
+bool gdb_if_connected(int link);
+bool gdb_if_pending(int link);
+/* True once a whole $...#xx is buffered, so reading it can't block */
+bool gdb_if_packet_pending(int link);
+void gdb_if_wait(uint32_t ms);
 
 #endif
 
@@ -23,10 +23,14 @@
 
 #include <stdarg.h>
 
+#include "target.h"
+
 int gdb_getpacket(char *packet, int size);
 void gdb_putpacket(const char *packet, int size);
 #define gdb_putpacketz(packet) gdb_putpacket((packet), strlen(packet))
 void gdb_putpacket_f(const char *packet, ...);
+bool gdb_putpacket_mem(char prefix, target *t, target_addr addr, size_t len);
+bool gdb_set_noackmode(bool enable);
 
 void gdb_out(const char *buf);
 void gdb_voutf(const char *fmt, va_list);
@@ -45,6 +45,13 @@ void jtagtap_tdi_seq(const uint8_t final_tms, const uint8_t *DI, int ticks);
  * - DO may be point to the same address as DI.
  */
 
+void jtagtap_tdi_tdo_seq_deferred(uint8_t *DO, const uint8_t final_tms, const uint8_t *DI, int ticks);
+void jtagtap_sync(void);
+/* Platforms where every read costs a USB round trip may only fill DO in
+ * jtagtap_sync(), so several sequences can be collected in one go.  DO
+ * must stay valid until then.  Elsewhere this is jtagtap_tdi_tdo_seq().
+ */
+
 /* generic soft reset: 1, 1, 1, 1, 1, 0 */
 #define jtagtap_soft_reset()	\
 	jtagtap_tms_seq(0x1F, 6)
@@ -43,5 +43,12 @@ bool platform_target_get_power(void);
 void platform_target_set_power(bool power);
 void platform_request_boot(void);
 
+#ifdef PLATFORM_HAS_FREQUENCY
+/* Highest SWCLK/TCK rate in Hz, the platform rounds down to a rate it
+ * can generate. */
+void platform_max_frequency_set(uint32_t freq);
+uint32_t platform_max_frequency_get(void);
+#endif
+
 #endif
 
@@ -33,5 +33,14 @@ bool swdptap_seq_in_parity(uint32_t *data, int ticks);
 void swdptap_seq_out(uint32_t MS, int ticks);
 void swdptap_seq_out_parity(uint32_t MS, int ticks);
 
+#ifdef PLATFORM_HAS_SWD_TRANSFER
+/* Whole transactions for a DP with CTRL/STAT.ORUNDETECT set, where the
+ * data phase follows every ack.  A read returns its ack and reports a
+ * parity error in one exchange.  A write doesn't wait for its ack, which
+ * is stored to *ack, if not NULL, by the time the next read returns. */
+uint8_t swdptap_read(uint8_t request, uint32_t *data, bool *parity_error);
+void swdptap_write(uint8_t request, uint32_t data, uint8_t *ack);
+#endif
+
 #endif
 
@@ -32,8 +32,13 @@ typedef uint32_t target_addr;
 struct target_controller;
 
 int adiv5_swdp_scan(void);
+#ifdef PLATFORM_HAS_FREQUENCY
+extern uint32_t swdp_autotune_freq;
+#endif
 int jtag_scan(const uint8_t *lrlens);
 
+extern bool target_flash_incremental;
+
 bool target_foreach(void (*cb)(int i, target *t, void *context), void *context);
 void target_list_free(void);
 
@@ -48,6 +53,7 @@ const char *target_driver_name(target *t);
 const char *target_mem_map(target *t);
 int target_mem_read(target *t, void *dest, target_addr src, size_t len);
 int target_mem_write(target *t, target_addr dest, const void *src, size_t len);
+bool target_mem_crc32(target *t, target_addr base, size_t len, uint32_t *crc);
 /* Flash memory access functions */
 int target_flash_erase(target *t, target_addr addr, size_t len);
 int target_flash_write(target *t, target_addr dest, const void *src, size_t len);
@@ -58,6 +64,8 @@ size_t target_regs_size(target *t);
 const char *target_tdesc(target *t);
 void target_regs_read(target *t, void *data);
 void target_regs_write(target *t, const void *data);
+int target_reg_read(target *t, int reg, void *data, size_t max);
+int target_reg_write(target *t, int reg, const void *data, size_t len);
 
 /* Halt/resume functions */
 enum target_halt_reason {
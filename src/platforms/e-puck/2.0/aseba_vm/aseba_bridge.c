@@ -7,6 +7,8 @@
  * @creation date   28.06.2018
  */
 
+#include <string.h>
+
 #include "hal.h"
 #include "aseba_bridge.h"
 #include "aseba_can_interface.h"
@@ -43,62 +45,167 @@ void aseba_bridge(void *stream)
                       aseba_bridge_can_to_uart, (void *)stream);
 
 }
+
+/* Bytes from the stream are parsed in place, only the unfinished packet
+ * at the end is moved back to the start of the buffer. */
+#define UART_TO_CAN_BUFFER_SIZE     (4 * ASEBA_MAX_OUTER_PACKET_SIZE)
+/* The stream staying quiet that long in the middle of a packet means it is corrupt */
+#define UART_TO_CAN_TIMEOUT         TIME_MS2I(100)
+/* A packet the CAN bus can't take in that time is dropped, e.g. when no
+ * other node acknowledges the frames and the mailboxes never empty */
+#define UART_TO_CAN_SEND_TIMEOUT    TIME_MS2I(100)
+
+static uint32_t aseba_bridge_dropped = 0;
+
+/*
+ * Returns the size of the packet at the start of data, header included,
+ * 0 if it isn't complete yet or -1 if its header can't be right.
+ */
+static int aseba_bridge_packet_size(const uint8_t *data, size_t len)
+{
+    uint16_8_t length;
+
+    if (len < sizeof(length)) {
+        return 0;
+    }
+    memcpy(length.u8, data, sizeof(length));
+    /* Aseba transmits length minus the type. */
+    if (length.u16 + 2 > ASEBA_MAX_INNER_PACKET_SIZE) {
+        return -1;
+    }
+    if (len < (size_t)(4 + length.u16 + 2)) {
+        return 0;
+    }
+    return 4 + length.u16 + 2;
+}
+
+/*
+ * Sends a packet, waiting at most timeout for room in the send queue.
+ * The CAN lock is only held while queuing. Returns false if the packet
+ * was dropped.
+ */
+static bool aseba_bridge_send(const uint8_t *data, size_t size,
+                              uint16_t source, sysinterval_t timeout)
+{
+    systime_t start = chVTGetSystemTimeX();
+    bool sent;
+
+    while (true) {
+        aseba_can_lock();
+        sent = AsebaCanSendSpecificSource(data, size, source);
+        aseba_can_unlock();
+
+        if (sent) {
+            return true;
+        }
+        if (aseba_bridge_should_pause ||
+            chVTTimeElapsedSinceX(start) >= timeout) {
+            aseba_bridge_dropped++;
+            return false;
+        }
+        // wait for the TX interrupt to drain the queue
+        AsebaIdle();
+    }
+}
+
 static THD_FUNCTION(aseba_bridge_uart_to_can, arg)
 {
     chRegSetThreadName("aseba uart -> can");
     BaseChannel* stream = (BaseChannel*) arg;
 
-    uint16_8_t source, length;
-    source.u16 = length.u16 = 0;
-    static uint8_t data[ASEBA_MAX_PACKET_SIZE] = {0};
-    uint16_t nb_received = 0;
+    uint16_8_t source;
+    static uint8_t data[UART_TO_CAN_BUFFER_SIZE];
+    size_t len = 0, pos, nb_received;
+    sysinterval_t send_timeout;
+    int size;
 
     while (true) {
-        chnReadTimeout(stream, length.u8, sizeof(length), TIME_INFINITE);
-        chnReadTimeout(stream, source.u8, sizeof(source), TIME_MS2I(100));
-        nb_received = chnReadTimeout(stream, data, length.u16 + 2, TIME_MS2I(100));
+        // block for one byte, then take everything that already arrived
+        nb_received = chnReadTimeout(stream, data + len, 1,
+                                     len ? UART_TO_CAN_TIMEOUT : TIME_INFINITE);
+        if (nb_received) {
+            nb_received += chnReadTimeout(stream, data + len + 1,
+                                          sizeof(data) - len - 1, TIME_IMMEDIATE);
+        }
+        len += nb_received;
 
         if(aseba_bridge_should_pause){
             chBSemWait(&aseba_bridge_uart_to_can_pause);
-        }else if(nb_received == (length.u16 + 2)){
-            aseba_can_lock();
-            AsebaCanSendSpecificSource(data, length.u16 + 2, source.u16);
-            aseba_can_unlock();
-        }else{
-            //flush the buffer. Probably isn't usefull but still good to have it
-            while(chnReadTimeout(stream, data, 1, TIME_IMMEDIATE) != 0);
+            len = 0;
+            continue;
         }
+
+        pos = 0;
+        send_timeout = UART_TO_CAN_SEND_TIMEOUT;
+        while (pos < len) {
+            size = aseba_bridge_packet_size(data + pos, len - pos);
+            if (size == 0 && nb_received == 0) {
+                // timed out on an unfinished packet, look for a good one further on
+                size = -1;
+            }
+            if (size == 0) {
+                break;
+            } else if (size < 0) {
+                // framing error, resync one byte further
+                pos++;
+            } else {
+                memcpy(source.u8, data + pos + 2, sizeof(source));
+                // while the bus is stalled, don't wait again for each packet of the batch
+                send_timeout = aseba_bridge_send(data + pos + 4, size - 4,
+                                                 source.u16, send_timeout) ?
+                               UART_TO_CAN_SEND_TIMEOUT : TIME_IMMEDIATE;
+                pos += size;
+            }
+        }
+
+        // keep the unfinished packet for the next read
+        len -= pos;
+        memmove(data, data + pos, len);
     }
 }
 
+/* Received packets are gathered here with their length and source
+ * headers and written to the stream together. */
+#define CAN_TO_UART_BUFFER_SIZE     (4 * ASEBA_MAX_OUTER_PACKET_SIZE)
+
 static THD_FUNCTION(aseba_bridge_can_to_uart, arg)
 {
     chRegSetThreadName("aseba can -> uart");
     BaseSequentialStream *stream = (BaseSequentialStream *)arg;
     uint16_8_t source, length;
-    static uint8_t data[ASEBA_MAX_PACKET_SIZE];
+    static uint8_t data[CAN_TO_UART_BUFFER_SIZE];
+    size_t pos;
 
     while (true) {
 
         if(aseba_bridge_should_pause){
             chBSemWait(&aseba_bridge_can_to_uart_pause);
-        }else{
-            length.u16 = AsebaCanRecv(data,
-                                  ASEBA_MAX_INNER_PACKET_SIZE,
-                                  &source.u16);
-
-            if (length.u16 > 0) {
-                chEvtBroadcastFlags(&communications_event, ACTIVE_COMMUNICATION_FLAG);
-                /* Aseba transmits length minus the type. */
-                length.u16 -= 2;
-                streamWrite(stream, length.u8, sizeof(source));
-                streamWrite(stream, source.u8, sizeof(source));
-                streamWrite(stream, data, length.u16 + 2);
+        }else if(aseba_can_wait_packet(TIME_MS2I(100))){
+            chEvtBroadcastFlags(&communications_event, ACTIVE_COMMUNICATION_FLAG);
+            pos = 0;
+            // drain every complete packet, writing whenever the buffer could overflow
+            do {
+                if (pos + 4 + ASEBA_MAX_INNER_PACKET_SIZE > sizeof(data)) {
+                    streamWrite(stream, data, pos);
+                    pos = 0;
+                }
+                length.u16 = AsebaCanRecv(data + pos + 4,
+                                      ASEBA_MAX_INNER_PACKET_SIZE,
+                                      &source.u16);
+                if (length.u16 > 0) {
+                    /* Aseba transmits length minus the type. */
+                    length.u16 -= 2;
+                    memcpy(data + pos, length.u8, sizeof(length));
+                    memcpy(data + pos + 2, source.u8, sizeof(source));
+                    pos += 4 + (uint16_t)(length.u16 + 2);
+                }
+            } while (AsebaCanRecvPacketReady());
+
+            if (pos) {
+                streamWrite(stream, data, pos);
             }
-
             chEvtBroadcastFlags(&communications_event, NO_COMMUNICATION_FLAG);
-            chThdSleepMilliseconds(1);
-        }   
+        }
     }
 }
 
@@ -122,3 +229,8 @@ bool aseba_is_bridge(void)
 {
     return is_bridge;
 }
+
+uint32_t aseba_bridge_dropped_packets(void)
+{
+    return aseba_bridge_dropped;
+}
@@ -29,6 +29,8 @@ void resumeAsebaBridge(void);
 void pauseAsebaBridge(void);
 /** Returns true if the board is running in bridge mode. */
 bool aseba_is_bridge(void);
+/** Returns the number of USB packets dropped because the CAN bus didn't take them. */
+uint32_t aseba_bridge_dropped_packets(void);
 
 #ifdef __cplusplus
 }
@@ -23,34 +23,58 @@
 CanFrame aseba_can_send_queue[ASEBA_CAN_SEND_QUEUE_SIZE];
 CanFrame aseba_can_receive_queue[ASEBA_CAN_RECEIVE_QUEUE_SIZE];
 
-static THD_WORKING_AREA(can_rx_thread_wa, 256);
-static THD_FUNCTION(can_rx_thread, arg)
+// Signaled each time a mailbox frees up, senders wait on it when the send queue is full
+static BSEMAPHORE_DECL(aseba_can_tx_room, true);
+// Signaled when a received packet is complete
+static BSEMAPHORE_DECL(aseba_can_rx_packet, true);
+
+/*
+ * Called from the CAN RX interrupt when FIFO 0 holds frames.
+ * Empties the FIFO straight into the Aseba receive queue. The driver
+ * masks the interrupt before calling us, it is unmasked once the FIFO
+ * is empty.
+ */
+static void aseba_can_rx_full_cb(CANDriver *canp, uint32_t flags)
 {
-    (void)arg;
-    chRegSetThreadName("CAN rx");
-    while (1) {
-        CANRxFrame rxf;
-        CanFrame aseba_can_frame;
-        msg_t m = canReceive(&CAN_ASEBA, CAN_ANY_MAILBOX, &rxf, TIME_MS2I(1000));
-        if (m != MSG_OK) {
-            continue;
-        }
-        if (rxf.IDE) {
-            continue; // no extended id frames
-        }
-        if (rxf.RTR) {
-            continue; // no remote transmission request frames
-        }
-        aseba_can_frame.id = rxf.SID;
-        aseba_can_frame.len = rxf.DLC;
-        int i;
-        for (i = 0; i < aseba_can_frame.len; i++) {
-            aseba_can_frame.data[i] = rxf.data8[i];
-        }
-        AsebaCanFrameReceived(&aseba_can_frame);
+    (void)flags;
+    CAN_FIFOMailBox_TypeDef *mb = &canp->can->sFIFOMailBox[0];
+
+    // the filters only let standard data frames through
+    while (canp->can->RF0R & CAN_RF0R_FMP0) {
+        CanFrame *frame = AsebaCanRecvFrameSlot();
+        frame->id = mb->RIR >> 21;
+        frame->len = mb->RDTR & CAN_RDT0R_DLC;
+        frame->data32[0] = mb->RDLR;
+        frame->data32[1] = mb->RDHR;
+        canp->can->RF0R = CAN_RF0R_RFOM0;
+        AsebaCanRecvFrameStored();
+    }
+    canp->can->IER |= CAN_IER_FMPIE0;
+
+    if (AsebaCanRecvPacketReady()) {
+        chSysLockFromISR();
+        chBSemSignalI(&aseba_can_rx_packet);
+        chSysUnlockFromISR();
     }
 }
 
+/*
+ * Called from the CAN TX interrupt when mailboxes are empty.
+ * Refills them from the send queue, so frames go out back to back
+ * without a thread having to run.
+ */
+static void aseba_can_tx_empty_cb(CANDriver *canp, uint32_t flags)
+{
+    (void)canp;
+    (void)flags;
+
+    AsebaCanFrameSent();
+
+    chSysLockFromISR();
+    chBSemSignalI(&aseba_can_tx_room);
+    chSysUnlockFromISR();
+}
+
 void can_init(void)
 {
 
@@ -65,6 +89,22 @@ void can_init(void)
         .btr = CAN_BTR_SJW(1-1) | CAN_BTR_TS1(9-1) | CAN_BTR_TS2(6-1) | CAN_BTR_BRP(3-1)
     };
 
+    /* Single 32-bit mask filter to FIFO 0: any standard id, but IDE and RTR
+     * must be 0, so extended and remote frames are dropped by the hardware.
+     */
+    static const CANFilter can1_filter = {
+        .filter = 0,
+        .mode = 0,
+        .scale = 1,
+        .assignment = 0,
+        .register1 = 0,
+        .register2 = CAN_RI0R_IDE | CAN_RI0R_RTR
+    };
+
+    canSTM32SetFilters(&CAN_ASEBA, STM32_CAN_MAX_FILTERS / 2, 1, &can1_filter);
+    // set before starting, a frame handled by the driver's default path would mask the RX interrupt for good
+    CAN_ASEBA.txempty_cb = aseba_can_tx_empty_cb;
+    CAN_ASEBA.rxfull_cb = aseba_can_rx_full_cb;
     canStart(&CAN_ASEBA, &can1_config);
 }
 
@@ -76,9 +116,12 @@ void aseba_can_tx_dropped(void)
 {
 }
 
+/*
+ * Called with a free mailbox, either from a thread or from the TX interrupt,
+ * so it must not block.
+ */
 void aseba_can_send_frame(const CanFrame *frame)
 {
-    aseba_can_lock();
     CANTxFrame txf;
     txf.DLC = frame->len;
     txf.RTR = 0;
@@ -90,31 +133,39 @@ void aseba_can_send_frame(const CanFrame *frame)
         txf.data8[i] = frame->data[i];
     }
 
-    canTransmit(&CAN_ASEBA, CAN_ANY_MAILBOX, &txf, TIME_MS2I(100));
-    chThdSleepMilliseconds(1);
-
-    AsebaCanFrameSent();
-    aseba_can_unlock();
+    syssts_t sts = chSysGetStatusAndLockX();
+    canTryTransmitI(&CAN_ASEBA, CAN_ANY_MAILBOX, &txf);
+    chSysRestoreStatusX(sts);
 }
 
 // Returns true if there is enough space to send the frame
+// The send queue keeps calling it, so all three mailboxes get filled
 int aseba_can_is_frame_room(void)
 {
     return can_lld_is_tx_empty(&CAN_ASEBA, CAN_ANY_MAILBOX);
 }
 
+// Waits until a received packet is complete, returns false on timeout
+bool aseba_can_wait_packet(sysinterval_t timeout)
+{
+    return AsebaCanRecvPacketReady() ||
+           (chBSemWaitTimeout(&aseba_can_rx_packet, timeout) == MSG_OK);
+}
+
+// Waits until the TX interrupt made room in the send queue
+void AsebaIdle(void)
+{
+    chBSemWaitTimeout(&aseba_can_tx_room, TIME_MS2I(10));
+}
+
 void aseba_can_start(uint16 id)
 {
-    can_init();
-    chThdCreateStatic(can_rx_thread_wa,
-                      sizeof(can_rx_thread_wa),
-                      NORMALPRIO + 1,
-                      can_rx_thread,
-                      NULL);
     AsebaCanInit(id, aseba_can_send_frame, aseba_can_is_frame_room,
                  aseba_can_rx_dropped, aseba_can_tx_dropped,
                  aseba_can_send_queue, ASEBA_CAN_SEND_QUEUE_SIZE,
                  aseba_can_receive_queue, ASEBA_CAN_RECEIVE_QUEUE_SIZE);
+    // the queues must be ready before the interrupts start using them
+    can_init();
 }
 
 static MUTEX_DECL(can_lock);
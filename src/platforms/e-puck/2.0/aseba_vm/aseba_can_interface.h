@@ -19,6 +19,8 @@ extern "C" {
 
 void aseba_can_start(uint16 id);
 
+bool aseba_can_wait_packet(sysinterval_t timeout);
+
 void aseba_can_lock(void);
 void aseba_can_unlock(void);
 
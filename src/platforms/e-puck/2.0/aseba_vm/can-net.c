@@ -33,6 +33,10 @@
 
 #define ASEBA_MIN(a, b) (((a) < (b)) ? (a) : (b))
 
+#define CAN_FRAME_NONE 0xffff
+#define CAN_SOURCES 256
+#define RECV_PACKETS_SIZE 256
+
 
 /*!	This contains the state of the CAN implementation of Aseba network */
 static struct AsebaCan
@@ -49,14 +53,21 @@ static struct AsebaCan
 	// send buffer
 	CanFrame* sendQueue;
 	size_t sendQueueSize;
-	uint16 sendQueueInsertPos;
-	uint16 sendQueueConsumePos;
+	uint16 volatile sendQueueInsertPos; /*!< only moved by the sender */
+	uint16 volatile sendQueueConsumePos; /*!< only moved while draining, possibly from the TX interrupt */
 	
 	// reception buffer
 	CanFrame* recvQueue;
 	size_t recvQueueSize;
-	uint16 recvQueueInsertPos;
-	uint16 recvQueueConsumePos;
+	uint16 volatile recvQueueInsertPos;
+	uint16 volatile recvQueueConsumePos; /*!< only moved as frames arrive, AsebaCanRecv() just frees frames */
+	
+	// reassembly index
+	uint16 recvChainHead[CAN_SOURCES]; /*!< first frame of the packet being received from each source */
+	uint16 recvChainTail[CAN_SOURCES]; /*!< last frame of the packet being received from each source */
+	uint16 recvPackets[RECV_PACKETS_SIZE]; /*!< first frame of each complete packet, in order of arrival */
+	uint16 volatile recvPacketsInsertPos;
+	uint16 volatile recvPacketsConsumePos;
 
 	uint16 volatile sendQueueLock;
 	
@@ -167,22 +178,88 @@ static void AsebaCanRecvQueueGarbageCollect(void)
 	}
 }
 
-/*! Free frames associated with an id in the reception queue */
+/*! Mark the frames of a chain as unused */
+static void AsebaCanRecvQueueFreeChain(uint16 i)
+{
+	uint16 next;
+	
+	while (i != CAN_FRAME_NONE)
+	{
+		next = asebaCan.recvQueue[i].next;
+		asebaCan.recvQueue[i].used = 0;
+		i = next;
+	}
+}
+
+/*! Free the frames of the packet being received from a source */
 static void AsebaCanRecvQueueFreeFrames(uint16 id)
 {
-	uint16 i;
+	AsebaCanRecvQueueFreeChain(asebaCan.recvChainHead[id]);
+	asebaCan.recvChainHead[id] = CAN_FRAME_NONE;
+	asebaCan.recvChainTail[id] = CAN_FRAME_NONE;
+}
+
+/*! Make a complete packet available to AsebaCanRecv() */
+static void AsebaCanRecvPacketPush(uint16 head)
+{
+	uint16 temp = asebaCan.recvPacketsInsertPos + 1;
+	if (temp >= RECV_PACKETS_SIZE)
+		temp = 0;
 	
-	// for all used frames...
-	for (i = asebaCan.recvQueueConsumePos; i != asebaCan.recvQueueInsertPos;)
+	if (temp == asebaCan.recvPacketsConsumePos)
 	{
-		// if frame is of a specific id, mark frame as unused
-		if (CANID_TO_ID(asebaCan.recvQueue[i].id) == id)
-			asebaCan.recvQueue[i].used = 0;
-		
-		i++;
-		if (i >= asebaCan.recvQueueSize)
-			i = 0;
+		AsebaCanRecvQueueFreeChain(head);
+		asebaCan.receivedPacketDroppedFP();
+		return;
 	}
+	
+	asebaCan.recvPackets[asebaCan.recvPacketsInsertPos] = head;
+	asebaCan.recvPacketsInsertPos = temp;
+}
+
+/*! Add a stored frame to the packet of its source */
+static void AsebaCanRecvQueueLink(uint16 pos)
+{
+	uint16 type = CANID_TO_TYPE(asebaCan.recvQueue[pos].id);
+	uint16 source = CANID_TO_ID(asebaCan.recvQueue[pos].id);
+	
+	asebaCan.recvQueue[pos].next = CAN_FRAME_NONE;
+	
+	if (type == TYPE_SMALL_PACKET)
+	{
+		AsebaCanRecvPacketPush(pos);
+		return;
+	}
+	
+	// a new start means the previous packet of this source lost its stop
+	if (type == TYPE_PACKET_START)
+		AsebaCanRecvQueueFreeFrames(source);
+	
+	if (asebaCan.recvChainHead[source] == CAN_FRAME_NONE)
+		asebaCan.recvChainHead[source] = pos;
+	else
+		asebaCan.recvQueue[asebaCan.recvChainTail[source]].next = pos;
+	asebaCan.recvChainTail[source] = pos;
+	
+	if (type == TYPE_PACKET_STOP)
+	{
+		AsebaCanRecvPacketPush(asebaCan.recvChainHead[source]);
+		asebaCan.recvChainHead[source] = CAN_FRAME_NONE;
+		asebaCan.recvChainTail[source] = CAN_FRAME_NONE;
+	}
+}
+
+/*! Empty the reassembly index */
+static void AsebaCanRecvIndexReset(void)
+{
+	uint16 i;
+	for (i = 0; i < CAN_SOURCES; i++)
+	{
+		asebaCan.recvChainHead[i] = CAN_FRAME_NONE;
+		asebaCan.recvChainTail[i] = CAN_FRAME_NONE;
+	}
+	asebaCan.recvPacketsInsertPos = 0;
+	asebaCan.recvPacketsConsumePos = 0;
 }
 
 
@@ -204,6 +281,7 @@ void AsebaCanInit(uint16 id, AsebaCanSendFrameFP sendFrameFP, AsebaCanIntVoidFP
 	asebaCan.recvQueueSize = recvQueueSize;
 	asebaCan.recvQueueInsertPos = 0;
 	asebaCan.recvQueueConsumePos = 0;
+	AsebaCanRecvIndexReset();
 	
 	asebaCan.sendQueueLock = 0;
 }
@@ -253,7 +331,21 @@ uint16 AsebaCanSendSpecificSource(const uint8 *data, size_t size, uint16 source)
 
 uint16 AsebaCanRecvBufferEmpty(void) 
 {
-	return asebaCan.recvQueueInsertPos == asebaCan.recvQueueConsumePos;
+	// frames freed by AsebaCanRecv() stay behind the consume position until garbage collected
+	uint16 pos = asebaCan.recvQueueConsumePos;
+	while (pos != asebaCan.recvQueueInsertPos)
+	{
+		if (asebaCan.recvQueue[pos].used)
+			return 0;
+		if (++pos >= asebaCan.recvQueueSize)
+			pos = 0;
+	}
+	return 1;
+}
+
+uint16 AsebaCanRecvPacketReady(void)
+{
+	return asebaCan.recvPacketsInsertPos != asebaCan.recvPacketsConsumePos;
 }
 
 void AsebaCanFrameSent()
@@ -271,87 +363,62 @@ void AsebaCanFlushQueue(void)
 
 uint16 AsebaCanRecv(uint8 *data, size_t size, uint16 *source)
 {
-	int stopPos = -1;
-	uint16 stopId;
 	uint16 pos = 0;
-	uint16 i;
-	
-	// first scan for "short packets" and "stops"
-	for (i = asebaCan.recvQueueConsumePos; i != asebaCan.recvQueueInsertPos; )
-	{
-		if(asebaCan.recvQueue[i].used) {
-			
-			if (CANID_TO_TYPE(asebaCan.recvQueue[i].id) == TYPE_SMALL_PACKET)
-			{
-				// copy data
-				uint16 len = ASEBA_MIN(size, asebaCan.recvQueue[i].len);
-				memcpy(data, asebaCan.recvQueue[i].data, len);
-				*source = CANID_TO_ID(asebaCan.recvQueue[i].id);
-				asebaCan.recvQueue[i].used = 0;
-				
-				// garbage collect
-				AsebaCanRecvQueueGarbageCollect();
-				
-				return len;
-			}
-			// stop found, we thus must have seen start before
-			else if (CANID_TO_TYPE(asebaCan.recvQueue[i].id) == TYPE_PACKET_STOP)
-			{
-				stopPos = i;
-				stopId = CANID_TO_ID(asebaCan.recvQueue[i].id);
-				break;
-			}
-		}
-		i++;
-		if (i >= asebaCan.recvQueueSize)
-			i = 0;
-	}
+	uint16 i, next, temp;
 	
-	// if we haven't found anything
-	if (stopPos < 0)
+	// complete packets are indexed as they arrive, take the oldest one
+	if (asebaCan.recvPacketsConsumePos == asebaCan.recvPacketsInsertPos)
 		return 0;
 	
-	// collect data
-	*source = CANID_TO_ID(stopId);
-	i = asebaCan.recvQueueConsumePos;
-	while (1)
-	{
-		if(asebaCan.recvQueue[i].used) {
-
-			if (CANID_TO_ID(asebaCan.recvQueue[i].id) == stopId)
-			{
-			if (pos < size)
-					{
-					uint16 amount = ASEBA_MIN(asebaCan.recvQueue[i].len, size - pos);
-					memcpy(data + pos, asebaCan.recvQueue[i].data, amount);
-					pos += amount;
-				}
-				asebaCan.recvQueue[i].used = 0;
-			}
-			
-			if (i == stopPos)
-				break;
+	i = asebaCan.recvPackets[asebaCan.recvPacketsConsumePos];
+	*source = CANID_TO_ID(asebaCan.recvQueue[i].id);
 	
+	// collect data along the chain of frames
+	while (i != CAN_FRAME_NONE)
+	{
+		if (pos < size)
+		{
+			uint16 amount = ASEBA_MIN(asebaCan.recvQueue[i].len, size - pos);
+			memcpy(data + pos, asebaCan.recvQueue[i].data, amount);
+			pos += amount;
 		}
-		i++;
-		if (i >= asebaCan.recvQueueSize)
-			i = 0;
+		next = asebaCan.recvQueue[i].next;
+		asebaCan.recvQueue[i].used = 0;
+		i = next;
 	}
-
-	// garbage collect
-	AsebaCanRecvQueueGarbageCollect();
 	
+	temp = asebaCan.recvPacketsConsumePos + 1;
+	if (temp >= RECV_PACKETS_SIZE)
+		temp = 0;
+	asebaCan.recvPacketsConsumePos = temp;
+	
+	// the freed frames are garbage collected when the next frame arrives
 	return pos;
 }
 
 #define MAX_DROPPING_SOURCE 20
 static uint16 dropping[MAX_DROPPING_SOURCE];
 
+CanFrame *AsebaCanRecvFrameSlot(void)
+{
+	// a frame is never stored when it would fill the queue, so this one is free
+	return &asebaCan.recvQueue[asebaCan.recvQueueInsertPos];
+}
+
 void AsebaCanFrameReceived(const CanFrame *frame)
 {
-	
+	memcpy(AsebaCanRecvFrameSlot(), frame, sizeof(*frame));
+	AsebaCanRecvFrameStored();
+}
+
+void AsebaCanRecvFrameStored(void)
+{
+	const CanFrame *frame = AsebaCanRecvFrameSlot();
 	uint16 source = CANID_TO_ID(frame->id);
 	
+	// reclaim the frames freed by AsebaCanRecv()
+	AsebaCanRecvQueueGarbageCollect();
+	
 	// check whether this packet should be filtered or not
 	if (CANID_TO_TYPE(frame->id) == TYPE_SMALL_PACKET)
 	{
@@ -400,14 +467,14 @@ void AsebaCanFrameReceived(const CanFrame *frame)
 	}
 	else
 	{
-		uint16 temp;
-		// store and increment pos
-		memcpy(&asebaCan.recvQueue[asebaCan.recvQueueInsertPos], frame, sizeof(*frame));
-		asebaCan.recvQueue[asebaCan.recvQueueInsertPos].used = 1;
-		temp = asebaCan.recvQueueInsertPos + 1;
+		uint16 temp, pos = asebaCan.recvQueueInsertPos;
+		// the frame is already in place, index it and increment pos
+		asebaCan.recvQueue[pos].used = 1;
+		temp = pos + 1;
 		if (temp >= asebaCan.recvQueueSize)
 			temp = 0;
 		asebaCan.recvQueueInsertPos = temp;
+		AsebaCanRecvQueueLink(pos);
 	}
 }
 
@@ -421,6 +488,8 @@ void AsebaCanRecvFreeQueue(void)
 	
 	for(i = 0; i < MAX_DROPPING_SOURCE; i++) 
 		dropping[i] = 0;
+	
+	AsebaCanRecvIndexReset();
 }
 
 /*@}*/
@@ -49,10 +49,15 @@ extern "C" {
 /*!	the data that physically go on the CAN bus. Used to communicate with the CAN data layer */
 typedef struct
 {
-	uint8 data[8] __attribute__((aligned(sizeof(int)))); /*!< data payload */
+	union
+	{
+		uint8 data[8] __attribute__((aligned(sizeof(int)))); /*!< data payload */
+		uint32 data32[2]; /*!< data payload as words, as the data layer may store it */
+	};
 	unsigned id:11; /*!< CAN identifier */
 	unsigned len:4; /*!< amount of bytes used in data */
 	unsigned used:1; /*!< when frame is in a circular buffer, tell if it frame is used */
+	uint16 next; /*!< when frame is in the reception queue, index of the next frame of the same packet */
 } CanFrame;
 
 /*! Pointer to a void function */
@@ -122,12 +127,22 @@ uint16 AsebaShouldDropPacket(uint16 source, const uint8* data);
 /*! Data layer should call this function when a new CAN frame (max 8 bytes) is available */
 void AsebaCanFrameReceived(const CanFrame *frame);
 
+/*! Return the frame where the data layer can store the next received frame in place.
+	The frame must then be passed on with AsebaCanRecvFrameStored(). There always is one. */
+CanFrame *AsebaCanRecvFrameSlot(void);
+
+/*! Data layer should call this function once it has filled the frame returned by AsebaCanRecvFrameSlot() */
+void AsebaCanRecvFrameStored(void);
+
 /*! Data layer should call this function when the CAN frame (max 8 bytes) was sent successfully */
 void AsebaCanFrameSent(void);
 
 /*! Return true if the recv buffer is empty, false otherwise */
 uint16 AsebaCanRecvBufferEmpty(void);
 
+/*! Return true if AsebaCanRecv() has a complete packet to return */
+uint16 AsebaCanRecvPacketReady(void);
+
 /*@}*/
 
 #ifdef __cplusplus
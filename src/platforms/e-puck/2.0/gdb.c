@@ -48,14 +48,16 @@ static THD_FUNCTION(gdb_thd, arg)
 
 void gdbStart(void){
 	/**
-	 * Starts a Systick emulation for GDB
+	 * Sets up the time base for GDB
 	 */
 	platform_timing_init();
 
 	/**
 	 * Starts the GDB thread
+	 * It only blocks while waiting for GDB, so it runs below the other
+	 * threads to leave them the CPU during long transfers
 	 */
-	chThdCreateStatic(gdb_thd_wa, sizeof(gdb_thd_wa), NORMALPRIO, gdb_thd, NULL);
+	chThdCreateStatic(gdb_thd_wa, sizeof(gdb_thd_wa), NORMALPRIO - 1, gdb_thd, NULL);
 
 }
 
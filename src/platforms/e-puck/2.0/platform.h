@@ -99,8 +99,30 @@
 
 #define SWDIO_MODE_DRIVE() {palSetLineMode(LINE_SWD_407_DIO, PAL_MODE_OUTPUT_PUSHPULL);}
 
+/* Busy-wait iterations per SWCLK half period, 0 runs at full GPIO speed.
+ * SWCLK has not been measured yet, so start at about 1MHz by the cycle
+ * estimates in stm32-ChibiOS/swdptap.c; "monitor freq" can raise it. */
+#ifndef SWD_DELAY_CNT
+#define SWD_DELAY_CNT	10
+#endif
+extern int swd_delay_cnt;
+
 #define DEBUG(...)
 
+#define PLATFORM_HAS_FREQUENCY
+/* The frequency is computed from unmeasured cycle counts */
+#define PLATFORM_FREQUENCY_ESTIMATED
+#define PLATFORM_HAS_GDB_IF_READ_PACKET
+
+/* GDB is served over USB and over Bluetooth through the ESP32 */
+#define PLATFORM_HAS_GDB_SESSIONS
+#define GDB_IF_USB	0
+#define GDB_IF_UART	1
+#define GDB_IF_LINKS	2
+
+/* Fewer round trips matter most over the Bluetooth link */
+#define GDB_PACKET_BUFFER_SIZE	16384
+
 #define SET_RUN_STATE(state)	{gdbSetFlag(state ? RUNNING_FLAG : IDLE_FLAG);};
 #define SET_PROGRAMMING_STATE()	{gdbSetFlag(PROGRAMMING_FLAG);};
 #define SET_IDLE_STATE(state)	{};
@@ -39,6 +39,7 @@
 
 #include "general.h"
 #include "gdb_if.h"
+#include "gdb_packet.h"
 
 static int gdb_if_serv, gdb_if_conn;
 
@@ -78,6 +79,8 @@ unsigned char gdb_if_getchar(void)
 		if(gdb_if_conn <= 0) {
 			gdb_if_conn = accept(gdb_if_serv, NULL, NULL);
 			DEBUG("Got connection\n");
+			/* A dropped connection is not seen as a detach */
+			gdb_set_noackmode(false);
 		}
 		i = recv(gdb_if_conn, (void*)&ret, 1, 0);
 		if(i <= 0) {
@@ -53,6 +53,11 @@ int jtagtap_init(void)
 {
 	assert(ftdic != NULL);
 
+	/* The SW-DP may have left TDI as an input */
+	uint8_t pins[3] = {SET_BITS_LOW, active_cable->dbus_data,
+	                   active_cable->dbus_ddr};
+	platform_buffer_write(pins, sizeof(pins));
+
 	/* Go to JTAG mode for SWJ-DP */
 	for (int i = 0; i <= 50; i++)
 		jtagtap_next(1, 0);		/* Reset SW-DP */
@@ -123,8 +128,35 @@ jtagtap_tdi_seq(const uint8_t final_tms, const uint8_t *DI, int ticks)
 #endif
 
 #ifndef PROVIDE_GENERIC_TAP_TDI_TDO_SEQ
+/* Unpack the reply to a jtagtap_tdi_tdo_seq_deferred() into DO,
+ * arg holds the trailing bit count and final_tms. */
+static void jtagtap_tdo_decode(void *dest, const uint8_t *tmp, int rsize,
+                               int arg)
+{
+	uint8_t *DO = dest;
+	int rticks = arg & 7;
+	bool final_tms = arg & 8;
+	int index = 0;
+
+	if(final_tms) rsize--;
+
+	while(rsize--) {
+		*DO++ = tmp[index++];
+	}
+	if (rticks == 0)
+		*DO++ = 0;
+	if(final_tms) {
+		rticks++;
+		*(--DO) >>= 1;
+		*DO |= tmp[index] & 0x80;
+	} else DO--;
+	if(rticks) {
+		*DO >>= (8-rticks);
+	}
+}
+
 void
-jtagtap_tdi_tdo_seq(uint8_t *DO, const uint8_t final_tms, const uint8_t *DI, int ticks)
+jtagtap_tdi_tdo_seq_deferred(uint8_t *DO, const uint8_t final_tms, const uint8_t *DI, int ticks)
 {
 	uint8_t *tmp;
 	int index = 0, rsize;
@@ -132,7 +164,6 @@ jtagtap_tdi_tdo_seq(uint8_t *DO, const uint8_t final_tms, const uint8_t *DI, int
 
 	if(!ticks) return;
 
-//	printf("ticks: %d\n", ticks);
 	if(final_tms) ticks--;
 	rticks = ticks & 7;
 	ticks >>= 3;
@@ -158,32 +189,21 @@ jtagtap_tdi_tdo_seq(uint8_t *DO, const uint8_t final_tms, const uint8_t *DI, int
 		tmp[index++] = 0;
 		tmp[index++] = (*DI)>>rticks?0x81:0x01;
 	}
-//	assert(ftdi_write_data(ftdic, tmp, index) == index);
 	platform_buffer_write(tmp, index);
-//	index = 0;
-//	while((index += ftdi_read_data(ftdic, tmp + index, rsize-index)) != rsize);
-	platform_buffer_read(tmp, rsize);
-	/*for(index = 0; index < rsize; index++)
-		printf("%02X ", tmp[index]);
-	printf("\n");*/
-	index = 0;
-	if(final_tms) rsize--;
+	platform_buffer_read_deferred(rsize, jtagtap_tdo_decode, DO,
+	                              rticks | (final_tms ? 8 : 0));
+}
 
-	while(rsize--) {
-		/*if(rsize) printf("%02X ", tmp[index]);*/
-		*DO++ = tmp[index++];
-	}
-	if (rticks == 0)
-		*DO++ = 0;
-	if(final_tms) {
-		rticks++;
-		*(--DO) >>= 1;
-		*DO |= tmp[index] & 0x80;
-	} else DO--;
-	if(rticks) {
-		*DO >>= (8-rticks);
-	}
-	/*printf("%02X\n", *DO);*/
+void
+jtagtap_tdi_tdo_seq(uint8_t *DO, const uint8_t final_tms, const uint8_t *DI, int ticks)
+{
+	jtagtap_tdi_tdo_seq_deferred(DO, final_tms, DI, ticks);
+	platform_buffer_sync();
+}
+
+void jtagtap_sync(void)
+{
+	platform_buffer_sync();
 }
 #endif
 
@@ -28,20 +28,44 @@
 struct ftdi_context *ftdic;
 
 #define BUF_SIZE 4096
-static uint8_t outbuf[BUF_SIZE];
+static uint8_t outbuf_mem[2][BUF_SIZE];
+static uint8_t *outbuf = outbuf_mem[0];
 static uint16_t bufptr = 0;
 
-static struct cable_desc_s {
-	int vendor;
-	int product;
-	int interface;
-	uint8_t dbus_data;
-	uint8_t dbus_ddr;
-	uint8_t cbus_data;
-	uint8_t cbus_ddr;
-	char *description;
-	char * name;
-} cable_desc[] = {
+#ifdef LIBFTDI1
+/* With -a a full buffer is submitted to libusb and filled again only
+ * once its transfer completed, commands are collected in the other
+ * buffer meanwhile. */
+static bool async_mode;
+static struct ftdi_transfer_control *write_tc[2];
+
+static void platform_buffer_write_done(int i)
+{
+	if (!write_tc[i])
+		return;
+	assert(ftdi_transfer_data_done(write_tc[i]) >= 0);
+	write_tc[i] = NULL;
+}
+#endif
+
+/* Reads queued by platform_buffer_read_deferred() and not collected yet.
+ * The byte limit keeps the replies within the receive buffer of the
+ * smallest MPSSE part (384 bytes on the FT2232D), so the chip never
+ * stalls on data we have not asked for. */
+#define READ_QUEUE_LEN		64
+#define READ_QUEUE_BYTES	256
+static struct {
+	platform_read_cb cb;
+	void *dest;
+	int size;
+	int arg;
+} read_queue[READ_QUEUE_LEN];
+static int read_queue_len = 0;
+static int read_queue_bytes = 0;
+
+struct cable_desc_s *active_cable;
+
+static struct cable_desc_s cable_desc[] = {
 	{
 		.vendor = 0x0403,
 		.product = 0x6010,
@@ -130,6 +154,11 @@ static struct cable_desc_s {
 	},
 };
 
+/* MPSSE clock before the divisor, high speed parts are left with their
+ * divide by 5 prescaler enabled so all cables run from 12MHz. */
+#define MPSSE_BASE_CLOCK	12000000
+static uint16_t tck_divisor = 1;
+
 void platform_init(int argc, char **argv)
 {
 	int err;
@@ -137,17 +166,35 @@ void platform_init(int argc, char **argv)
 	unsigned index = 0;
 	char *serial = NULL;
 	char * cablename =  "ftdi";
-	uint8_t ftdi_init[9] = {TCK_DIVISOR, 0x01, 0x00, SET_BITS_LOW, 0,0,
+	int latency = 0, read_chunk = 0, write_chunk = 0;
+	uint8_t ftdi_init[9] = {TCK_DIVISOR, tck_divisor & 0xff,
+				tck_divisor >> 8, SET_BITS_LOW, 0,0,
 				SET_BITS_HIGH, 0,0};
 
-	while((c = getopt(argc, argv, "c:s:")) != -1) {
+	while((c = getopt(argc, argv, "ac:s:l:r:w:")) != -1) {
 		switch(c) {
+		case 'a':
+#ifdef LIBFTDI1
+			async_mode = true;
+#else
+			fprintf(stderr, "Asynchronous transfers need libftdi1\n");
+#endif
+			break;
 		case 'c':
 			cablename =  optarg;
 			break;
 		case 's':
 			serial = optarg;
 			break;
+		case 'l':
+			latency = strtol(optarg, NULL, 0);
+			break;
+		case 'r':
+			read_chunk = strtol(optarg, NULL, 0);
+			break;
+		case 'w':
+			write_chunk = strtol(optarg, NULL, 0);
+			break;
 		}
 	}
 
@@ -161,6 +208,8 @@ void platform_init(int argc, char **argv)
 		exit(-1);
 	}
 
+	active_cable = &cable_desc[index];
+
 	if (cable_desc[index].dbus_data)
 		ftdi_init[4]= cable_desc[index].dbus_data;
 	if (cable_desc[index].dbus_ddr)
@@ -170,12 +219,23 @@ void platform_init(int argc, char **argv)
 	if(cable_desc[index].cbus_ddr)
 		ftdi_init[8]= cable_desc[index].cbus_ddr;
 
+	if (!latency)
+		latency = cable_desc[index].latency ? : 1;
+	if (!read_chunk)
+		read_chunk = cable_desc[index].read_chunk;
+	if (!write_chunk)
+		write_chunk = cable_desc[index].write_chunk ? : BUF_SIZE;
+
 	printf("\nBlack Magic Probe (" FIRMWARE_VERSION ")\n");
 	printf("Copyright (C) 2015  Black Sphere Technologies Ltd.\n");
 	printf("License GPLv3+: GNU GPL version 3 or later "
 	       "<http://gnu.org/licenses/gpl.html>\n\n");
 
 	if(ftdic) {
+#ifdef LIBFTDI1
+		platform_buffer_write_done(0);
+		platform_buffer_write_done(1);
+#endif
 		ftdi_usb_close(ftdic);
 		ftdi_free(ftdic);
 		ftdic = NULL;
@@ -198,7 +258,7 @@ void platform_init(int argc, char **argv)
 		abort();
 	}
 
-	if((err = ftdi_set_latency_timer(ftdic, 1)) != 0) {
+	if((err = ftdi_set_latency_timer(ftdic, latency)) != 0) {
 		fprintf(stderr, "ftdi_set_latency_timer: %d: %s\n",
 			err, ftdi_get_error_string(ftdic));
 		abort();
@@ -213,11 +273,17 @@ void platform_init(int argc, char **argv)
 			err, ftdi_get_error_string(ftdic));
 		abort();
 	}
-	if((err = ftdi_write_data_set_chunksize(ftdic, BUF_SIZE)) != 0) {
+	if((err = ftdi_write_data_set_chunksize(ftdic, write_chunk)) != 0) {
 		fprintf(stderr, "ftdi_write_data_set_chunksize: %d: %s\n",
 			err, ftdi_get_error_string(ftdic));
 		abort();
 	}
+	if(read_chunk &&
+	   (err = ftdi_read_data_set_chunksize(ftdic, read_chunk)) != 0) {
+		fprintf(stderr, "ftdi_read_data_set_chunksize: %d: %s\n",
+			err, ftdi_get_error_string(ftdic));
+		abort();
+	}
 
 	if((err = ftdi_set_bitmode(ftdic, 0xAB, BITMODE_MPSSE)) != 0) {
 		fprintf(stderr, "ftdi_set_bitmode: %d: %s\n",
@@ -239,6 +305,21 @@ bool platform_srst_get_val(void) { return false; }
 
 void platform_buffer_flush(void)
 {
+#ifdef LIBFTDI1
+	if (async_mode) {
+		int i = (outbuf == outbuf_mem[0]) ? 0 : 1;
+
+		if (!bufptr)
+			return;
+		write_tc[i] = ftdi_write_data_submit(ftdic, outbuf, bufptr);
+		assert(write_tc[i] != NULL);
+		i ^= 1;
+		platform_buffer_write_done(i);
+		outbuf = outbuf_mem[i];
+		bufptr = 0;
+		return;
+	}
+#endif
 	assert(ftdi_write_data(ftdic, outbuf, bufptr) == bufptr);
 //	printf("FT2232 platform_buffer flush: %d bytes\n", bufptr);
 	bufptr = 0;
@@ -252,14 +333,91 @@ int platform_buffer_write(const uint8_t *data, int size)
 	return size;
 }
 
-int platform_buffer_read(uint8_t *data, int size)
+void platform_max_frequency_set(uint32_t freq)
+{
+	uint32_t div = 0xffff;
+
+	/* TCK = base / (2 * (1 + divisor)), round the divisor up */
+	if (freq)
+		div = (MPSSE_BASE_CLOCK / 2 + freq - 1) / freq;
+	if (div)
+		div--;
+	if (div > 0xffff)
+		div = 0xffff;
+	tck_divisor = div;
+
+	/* Before platform_init() the divisor is only remembered */
+	if (ftdic && (ftdic->bitbang_mode == BITMODE_MPSSE)) {
+		uint8_t cmd[3] = {TCK_DIVISOR, div & 0xff, div >> 8};
+		platform_buffer_write(cmd, 3);
+		platform_buffer_flush();
+	}
+}
+
+uint32_t platform_max_frequency_get(void)
+{
+	return MPSSE_BASE_CLOCK / (2 * (1 + tck_divisor));
+}
+
+static void platform_buffer_read_raw(uint8_t *data, int size)
 {
 	int index = 0;
 	platform_buffer_flush();
+#ifdef LIBFTDI1
+	if (async_mode) {
+		/* The read is queued behind the writes still in flight */
+		struct ftdi_transfer_control *tc;
+		tc = ftdi_read_data_submit(ftdic, data, size);
+		assert(tc && (ftdi_transfer_data_done(tc) == size));
+		platform_buffer_write_done(0);
+		platform_buffer_write_done(1);
+		return;
+	}
+#endif
 	while((index += ftdi_read_data(ftdic, data + index, size-index)) != size);
+}
+
+int platform_buffer_read(uint8_t *data, int size)
+{
+	platform_buffer_sync();
+	platform_buffer_read_raw(data, size);
 	return size;
 }
 
+void platform_buffer_read_deferred(int size, platform_read_cb cb,
+                                   void *dest, int arg)
+{
+	if ((read_queue_len == READ_QUEUE_LEN) ||
+	    (read_queue_len && (read_queue_bytes + size > READ_QUEUE_BYTES)))
+		platform_buffer_sync();
+
+	read_queue[read_queue_len].cb = cb;
+	read_queue[read_queue_len].dest = dest;
+	read_queue[read_queue_len].size = size;
+	read_queue[read_queue_len].arg = arg;
+	read_queue_len++;
+	read_queue_bytes += size;
+}
+
+void platform_buffer_sync(void)
+{
+	uint8_t *data;
+	int i, index = 0;
+
+	if (!read_queue_len)
+		return;
+
+	data = alloca(read_queue_bytes);
+	platform_buffer_read_raw(data, read_queue_bytes);
+	for (i = 0; i < read_queue_len; i++) {
+		read_queue[i].cb(read_queue[i].dest, data + index,
+		                 read_queue[i].size, read_queue[i].arg);
+		index += read_queue[i].size;
+	}
+	read_queue_len = 0;
+	read_queue_bytes = 0;
+}
+
 #ifdef WIN32
 #warning "This vasprintf() is dubious!"
 int vasprintf(char **strp, const char *fmt, va_list ap)
@@ -37,6 +37,10 @@
 #define FT2232_PID	0x6010
 
 #define PLATFORM_HAS_DEBUG
+#define PLATFORM_HAS_FREQUENCY
+#define PLATFORM_HAS_SWD_TRANSFER
+
+#define GDB_PACKET_BUFFER_SIZE	16384
 
 #define SET_RUN_STATE(state)
 #define SET_IDLE_STATE(state)
@@ -44,10 +48,38 @@
 
 extern struct ftdi_context *ftdic;
 
+struct cable_desc_s {
+	int vendor;
+	int product;
+	int interface;
+	uint8_t dbus_data;
+	uint8_t dbus_ddr;
+	uint8_t cbus_data;
+	uint8_t cbus_ddr;
+	/* USB tuning, zero keeps the default.  -l, -r and -w override. */
+	uint8_t latency;
+	unsigned int read_chunk;
+	unsigned int write_chunk;
+	char *description;
+	char * name;
+};
+
+/* Cable selected on the command line */
+extern struct cable_desc_s *active_cable;
+
 void platform_buffer_flush(void);
 int platform_buffer_write(const uint8_t *data, int size);
 int platform_buffer_read(uint8_t *data, int size);
 
+/* Queue a read of size bytes, cb decodes them into dest once they have
+ * arrived.  Replies are collected in one transfer by platform_buffer_sync(),
+ * which runs before any immediate read and whenever the queue fills up. */
+typedef void (*platform_read_cb)(void *dest, const uint8_t *data,
+                                 int size, int arg);
+void platform_buffer_read_deferred(int size, platform_read_cb cb,
+                                   void *dest, int arg);
+void platform_buffer_sync(void);
+
 static inline int platform_hwversion(void)
 {
 	        return 0;
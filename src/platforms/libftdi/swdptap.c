@@ -18,8 +18,12 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-/* Quick hack for bit-banging SW-DP interface over FT2232.
- * Intended as proof of concept, not for production.
+/* Low level SW-DP interface using the MPSSE engine of FT2232H/FT232H
+ * style cables.  SWCLK is TCK, SWDIO is driven from TDI and read back
+ * on TDO, so the two are tied together at the target, TDI through a
+ * series resistor.  TDI is switched to an input while the target
+ * drives SWDIO.  Everything the probe sends is only buffered, a USB
+ * round trip happens when the data read back from the target is needed.
  */
 
 #include <stdio.h>
@@ -29,21 +33,36 @@
 #include "general.h"
 #include "swdptap.h"
 
+#define MPSSE_TCK	0x01
+#define MPSSE_TDI	0x02
+#define MPSSE_TDO	0x04
+
+/* Shift commands, LSB first, written on the falling edge of SWCLK and
+ * read on the rising edge */
+#define SWD_WRITE_BYTES	(MPSSE_DO_WRITE | MPSSE_WRITE_NEG | MPSSE_LSB)
+#define SWD_WRITE_BITS	(SWD_WRITE_BYTES | MPSSE_BITMODE)
+#define SWD_READ_BYTES	(MPSSE_DO_READ | MPSSE_LSB)
+#define SWD_READ_BITS	(SWD_READ_BYTES | MPSSE_BITMODE)
+
 static uint8_t olddir = 0;
 
-int swdptap_init(void)
+static void swdptap_set_bits(bool drive)
 {
-	int err;
+	uint8_t ddr = (active_cable->dbus_ddr | MPSSE_TCK) & ~MPSSE_TDO;
+	uint8_t cmd[3] = {SET_BITS_LOW, active_cable->dbus_data & ~MPSSE_TCK,
+	                  drive ? ddr | MPSSE_TDI : ddr & ~MPSSE_TDI};
 
-	assert(ftdic != NULL);
+	platform_buffer_write(cmd, sizeof(cmd));
+}
 
-	if((err = ftdi_set_bitmode(ftdic, 0xAB, BITMODE_BITBANG)) != 0) {
-		fprintf(stderr, "ftdi_set_bitmode: %d: %s\n",
-			err, ftdi_get_error_string(ftdic));
-		abort();
-	}
+int swdptap_init(void)
+{
+	assert(ftdic != NULL);
+	assert(ftdic->bitbang_mode == BITMODE_MPSSE);
 
-	assert(ftdi_write_data(ftdic, (void*)"\xAB\xA8", 2) == 2);
+	/* Start with the probe driving SWDIO */
+	swdptap_set_bits(true);
+	platform_buffer_flush();
 	olddir = 0;
 
 	return 0;
@@ -51,45 +70,142 @@ int swdptap_init(void)
 
 static void swdptap_turnaround(uint8_t dir)
 {
-	platform_buffer_flush();
-
+	/* Don't turnaround if direction not changing */
 	if (dir == olddir)
 		return;
 	olddir = dir;
 
-	if(dir)	/* SWDIO goes to input */
-		assert(ftdi_set_bitmode(ftdic, 0xA3, BITMODE_BITBANG) == 0);
+	if (dir)	/* SWDIO goes to input */
+		swdptap_set_bits(false);
 
 	/* One clock cycle */
-	ftdi_write_data(ftdic, (void *)"\xAB\xA8", 2);
+	platform_buffer_write((uint8_t []){CLK_BITS, 0}, 2);
 
-	if(!dir) /* SWDIO goes to output */
-		assert(ftdi_set_bitmode(ftdic, 0xAB, BITMODE_BITBANG) == 0);
+	if (!dir)	/* SWDIO goes to output */
+		swdptap_set_bits(true);
 }
 
-bool swdptap_bit_in(void)
+/* Clock in up to 64 bits with a single USB round trip */
+static uint64_t swdptap_mpsse_in(int ticks)
 {
-	uint8_t ret;
+	uint8_t cmd[6], data[9];
+	int bytes = ticks / 8, bits = ticks % 8, len = 0, rlen = bytes;
+	uint64_t ret = 0;
 
 	swdptap_turnaround(1);
 
-	ftdi_read_pins(ftdic, &ret);
-	ret &= 0x08;
-	ftdi_write_data(ftdic, (void *)"\xA1\xA0", 2);
-
+	if (bytes) {
+		cmd[len++] = SWD_READ_BYTES;
+		cmd[len++] = bytes - 1;
+		cmd[len++] = 0;
+	}
+	if (bits) {
+		cmd[len++] = SWD_READ_BITS;
+		cmd[len++] = bits - 1;
+		rlen++;
+	}
+	cmd[len++] = SEND_IMMEDIATE;
+	platform_buffer_write(cmd, len);
+	platform_buffer_read(data, rlen);
+
+	/* Partial bytes are shifted in from the top */
+	if (bits)
+		data[bytes] >>= 8 - bits;
+	for (int i = rlen - 1; i >= 0; i--)
+		ret = (ret << 8) | data[i];
 	return ret;
 }
 
-void swdptap_bit_out(bool val)
+static void swdptap_mpsse_out(uint64_t MS, int ticks)
 {
-	uint8_t buf[3] = "\xA0\xA1\xA0";
+	uint8_t cmd[14];
+	int bytes = ticks / 8, bits = ticks % 8, len = 0;
 
 	swdptap_turnaround(0);
 
-	if (val) {
-		for(int i = 0; i < 3; i++)
-			buf[i] |= 0x08;
+	if (bytes) {
+		cmd[len++] = SWD_WRITE_BYTES;
+		cmd[len++] = bytes - 1;
+		cmd[len++] = 0;
+		for (int i = 0; i < bytes; i++, MS >>= 8)
+			cmd[len++] = MS & 0xff;
 	}
-	platform_buffer_write(buf, 3);
+	if (bits) {
+		cmd[len++] = SWD_WRITE_BITS;
+		cmd[len++] = bits - 1;
+		cmd[len++] = MS & 0xff;
+	}
+	platform_buffer_write(cmd, len);
+}
+
+bool swdptap_bit_in(void)
+{
+	return swdptap_mpsse_in(1);
+}
+
+void swdptap_bit_out(bool val)
+{
+	swdptap_mpsse_out(val, 1);
 }
 
+uint32_t swdptap_seq_in(int ticks)
+{
+	return swdptap_mpsse_in(ticks);
+}
+
+bool swdptap_seq_in_parity(uint32_t *ret, int ticks)
+{
+	/* Data and parity in one go */
+	uint64_t data = swdptap_mpsse_in(ticks + 1);
+
+	*ret = data & ((ticks < 32) ? (1u << ticks) - 1 : 0xffffffff);
+	return __builtin_parityll(data & ((2ull << ticks) - 1));
+}
+
+void swdptap_seq_out(uint32_t MS, int ticks)
+{
+	swdptap_mpsse_out(MS, ticks);
+}
+
+void swdptap_seq_out_parity(uint32_t MS, int ticks)
+{
+	uint64_t data = (ticks < 32) ? MS & ((1u << ticks) - 1) : MS;
+
+	data |= (uint64_t)__builtin_parity(data) << ticks;
+	swdptap_mpsse_out(data, ticks + 1);
+}
+
+uint8_t swdptap_read(uint8_t request, uint32_t *data, bool *parity_error)
+{
+	uint64_t in;
+
+	/* Ack, data and parity in one go */
+	swdptap_mpsse_out(request, 8);
+	in = swdptap_mpsse_in(36);
+
+	*data = in >> 3;
+	*parity_error = __builtin_parityll((in >> 3) & 0x1ffffffffull);
+	return in & 7;
+}
+
+static void swdptap_ack_decode(void *dest, const uint8_t *data, int size,
+                               int arg)
+{
+	(void)size;
+	(void)arg;
+	/* Partial bytes are shifted in from the top */
+	*(uint8_t *)dest = data[0] >> 5;
+}
+
+void swdptap_write(uint8_t request, uint32_t data, uint8_t *ack)
+{
+	swdptap_mpsse_out(request, 8);
+	swdptap_turnaround(1);
+	if (ack) {
+		platform_buffer_write((uint8_t []){SWD_READ_BITS, 2}, 2);
+		platform_buffer_read_deferred(1, swdptap_ack_decode, ack, 0);
+	} else {
+		platform_buffer_write((uint8_t []){CLK_BITS, 2}, 2);
+	}
+	swdptap_seq_out_parity(data, 32);
+}
@@ -98,6 +98,9 @@ uint32_t generic_crc32(target *t, uint32_t base, size_t len)
 	uint32_t crc = -1;
 	uint8_t bytes[128];
 
+	if (target_mem_crc32(t, base, len, &crc))
+		return crc;
+
 	while (len) {
 		size_t read_len = MIN(sizeof(bytes), len);
 		target_mem_read(t, bytes, base, read_len);
@@ -111,3 +114,13 @@ uint32_t generic_crc32(target *t, uint32_t base, size_t len)
 	return crc;
 }
 
+/* CRC of len bytes of value, such as a blank flash block */
+uint32_t crc32_fill(uint8_t value, size_t len)
+{
+	uint32_t crc = -1;
+
+	while (len--)
+		crc = crc32_calc(crc, value);
+	return crc;
+}
+
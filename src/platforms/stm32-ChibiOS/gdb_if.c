@@ -26,80 +26,310 @@
 #include "gdb_if.h"
 #include "usbcfg.h"
 
-static uint32_t count_out;
-static uint32_t count_in;
-static uint32_t out_ptr;
-static uint8_t buffer_out[USB_DATA_SIZE];
-static uint8_t buffer_in[USB_DATA_SIZE];
-#ifdef STM32F4
-//static volatile uint32_t count_new;
-//static uint8_t double_buffer_out[USB_DATA_SIZE];
-#endif
+/* Holds a whole monitor packet, see gdb_if_packet_pending() */
+#define GDB_IF_BUF_SIZE		512
 
-void gdb_if_putchar(unsigned char c, int flush)
+/* Each link has its own buffers, the gdb_if calls act on the one picked
+ * with gdb_if_select().  Input events wake the GDB thread. */
+struct gdb_if_link {
+	BaseChannel *chn;
+	event_listener_t listener;
+	uint32_t count_out;
+	uint32_t count_in;
+	uint32_t out_ptr;
+	uint8_t buffer_out[GDB_IF_BUF_SIZE];
+	uint8_t buffer_in[USB_DATA_SIZE];
+};
+
+static struct gdb_if_link links[GDB_IF_LINKS] = {
+	[GDB_IF_USB] = {.chn = (BaseChannel *) &USB_GDB},
+	[GDB_IF_UART] = {.chn = (BaseChannel *) &UART_ESP},
+};
+static struct gdb_if_link *cur = &links[GDB_IF_USB];
+static bool listening;
+
+#define GDB_IF_ALL_EVENTS	(EVENT_MASK(GDB_IF_LINKS) - 1)
+
+bool gdb_if_connected(int link)
 {
-	buffer_in[count_in++] = c;
-	if(flush || (count_in == USB_DATA_SIZE)) {
-		/* Refuse to send if USB isn't configured, and
-		 * don't bother if nobody's listening */
-		if(( isUSBConfigured() && getControlLineState(GDB_INTERFACE, CONTROL_LINE_DTR)) ) {
-			chnWrite((BaseChannel *) &USB_GDB, buffer_in, count_in);
-		}
+	if (link == GDB_IF_USB)
+		return isUSBConfigured() && getControlLineState(GDB_INTERFACE, CONTROL_LINE_DTR);
 
-		//send to the ESP's UART if GPIO0 is low and this UART is not already in use
-		if( communicationIsBluetoothConnected() && (communicationGetActiveMode() != UART_ESP_PASSTHROUGH) ) {
-			chnWrite((BaseChannel *) &UART_ESP, buffer_in, count_in);
-		}
+	//the ESP's UART is ours if GPIO0 is low and this UART is not already in use
+	return communicationIsBluetoothConnected() && (communicationGetActiveMode() != UART_ESP_PASSTHROUGH);
+}
+
+/* USB takes the debug session whenever a host has it open */
+int gdb_if_debug_link(void)
+{
+	if (!gdb_if_connected(GDB_IF_USB) && gdb_if_connected(GDB_IF_UART))
+		return GDB_IF_UART;
+	return GDB_IF_USB;
+}
 
-		count_in = 0;
+void gdb_if_select(int link)
+{
+	cur = &links[link];
+}
+
+static void gdb_if_send(const uint8_t *buf, uint32_t len)
+{
+	/* Refuse to send if the link is down */
+	if (gdb_if_connected(cur - links))
+		chnWrite(cur->chn, buf, len);
+}
+
+void gdb_if_putchar(unsigned char c, int flush)
+{
+	cur->buffer_in[cur->count_in++] = c;
+	if(flush || (cur->count_in == USB_DATA_SIZE)) {
+		gdb_if_send(cur->buffer_in, cur->count_in);
+		cur->count_in = 0;
 		return;
 	}
 }
 
-static void gdb_if_update_buf(uint32_t timeout)
+/* The serial-USB driver splits the data into endpoint sized packets and
+ * sends the remainder on the next SOF, so flush needs no extra work. */
+void gdb_if_write(const uint8_t *buf, int len, int flush)
+{
+	(void)flush;
+
+	if (cur->count_in) {
+		gdb_if_send(cur->buffer_in, cur->count_in);
+		cur->count_in = 0;
+	}
+	gdb_if_send(buf, len);
+}
+
+static void gdb_if_listen(void)
+{
+	/* Listeners belong to the thread that registers them */
+	if (listening)
+		return;
+	for (int i = 0; i < GDB_IF_LINKS; i++)
+		chEvtRegisterMaskWithFlags(chnGetEventSource(links[i].chn),
+		                           &links[i].listener, EVENT_MASK(i),
+		                           CHN_INPUT_AVAILABLE);
+	listening = true;
+}
+
+static void gdb_if_read_now(struct gdb_if_link *l)
+{
+	l->count_out = chnReadTimeout(l->chn, l->buffer_out, sizeof(l->buffer_out), TIME_IMMEDIATE);
+	l->out_ptr = 0;
+}
+
+/* Refill the selected link's buffer, sleeping up to timeout if it has
+ * no data. */
+static void gdb_if_update_buf(sysinterval_t timeout)
 {
 	while (!isUSBConfigured() && !communicationIsBluetoothConnected()){
 		chThdSleepMilliseconds(10);
 	}
 
-	count_out = chnReadTimeout((BaseChannel *) &USB_GDB, buffer_out, USB_DATA_SIZE, timeout);
+	gdb_if_listen();
 
-	if(count_out == 0 && communicationGetActiveMode() != UART_ESP_PASSTHROUGH){
-		count_out = chnReadTimeout((BaseChannel *) &UART_ESP, buffer_out, USB_DATA_SIZE, timeout);
+	/* Data that arrives after this read leaves an event pending, so
+	 * the wait below can't miss it. */
+	gdb_if_read_now(cur);
+	if (cur->count_out == 0 && timeout != TIME_IMMEDIATE) {
+		chEvtWaitAnyTimeout(EVENT_MASK(cur - links), timeout);
+		gdb_if_read_now(cur);
 	}
-	out_ptr = 0;
 }
 
-unsigned char gdb_if_getchar(void)
+bool gdb_if_pending(int link)
+{
+	struct gdb_if_link *l = &links[link];
+
+	if (l->out_ptr < l->count_out)
+		return true;
+	if (!gdb_if_connected(link))
+		return false;
+	gdb_if_listen();
+	gdb_if_read_now(l);
+	return l->count_out != 0;
+}
+
+/* Drop the bytes before the next '$', such as acks or a ^C, and check
+ * whether the packet it starts is complete */
+static bool gdb_if_packet_complete(struct gdb_if_link *l)
+{
+	uint8_t *p, *end = &l->buffer_out[l->count_out];
+
+	p = memchr(&l->buffer_out[l->out_ptr], '$', l->count_out - l->out_ptr);
+	if (!p) {
+		l->out_ptr = l->count_out = 0;
+		return false;
+	}
+	l->out_ptr = p - l->buffer_out;
+	p = memchr(p, '#', end - p);
+	return p && (end - p >= 3);
+}
+
+/* Packets are gathered from the start of the buffer, one that can't fit
+ * is dropped. */
+bool gdb_if_packet_pending(int link)
+{
+	struct gdb_if_link *l = &links[link];
+
+	if (!gdb_if_connected(link))
+		return false;
+	if (gdb_if_packet_complete(l))
+		return true;
+	gdb_if_listen();
+
+	/* Move the packet start to the front and append what arrived */
+	l->count_out -= l->out_ptr;
+	memmove(l->buffer_out, &l->buffer_out[l->out_ptr], l->count_out);
+	l->out_ptr = 0;
+	if (l->count_out == sizeof(l->buffer_out))
+		l->count_out = 0;
+	l->count_out += chnReadTimeout(l->chn, &l->buffer_out[l->count_out],
+	                               sizeof(l->buffer_out) - l->count_out,
+	                               TIME_IMMEDIATE);
+	return gdb_if_packet_complete(l);
+}
+
+void gdb_if_wait(uint32_t ms)
 {
+	gdb_if_listen();
+	chEvtWaitAnyTimeout(GDB_IF_ALL_EVENTS, TIME_MS2I(ms));
+}
 
-	while (!(out_ptr < count_out)) {
+/* Wait until the selected link holds unread data, false if it closed */
+static bool gdb_if_fill(void)
+{
+	while (!(cur->out_ptr < cur->count_out)) {
 		/* Detach if port closed */
-		if (!getControlLineState(GDB_INTERFACE, CONTROL_LINE_DTR) && !communicationIsBluetoothConnected())
-			return 0x04;
+		if (!gdb_if_connected(cur - links))
+			return false;
 
-		gdb_if_update_buf(TIME_MS2I(1));
+		gdb_if_update_buf(TIME_MS2I(10));
 	}
+	return true;
+}
 
-	return buffer_out[out_ptr++];
+/* Sum of len bytes, a word at a time.  The two 16 bit lanes can't carry
+ * into each other within the 64 words summed between folds. */
+static uint8_t gdb_if_csum(const uint8_t *buf, uint32_t len)
+{
+	uint32_t sum = 0, lanes, w;
+	int words;
+
+	while (len >= 4) {
+		lanes = 0;
+		for (words = 0; (words < 64) && (len >= 4); words++) {
+			memcpy(&w, buf, 4);
+			lanes += (w & 0x00ff00ff) + ((w >> 8) & 0x00ff00ff);
+			buf += 4;
+			len -= 4;
+		}
+		sum += (lanes & 0xffff) + (lanes >> 16);
+	}
+	while (len--)
+		sum += *buf++;
+
+	return sum;
+}
+
+int gdb_if_read_packet(char *packet, int size)
+{
+	const uint8_t *start, *p, *end;
+	uint8_t csum = 0;
+	char recv_csum[3];
+	bool overflow = false;
+	unsigned char c;
+	int i = 0;
+
+	/* Wait for packet start */
+	do {
+		if (!gdb_if_fill())
+			return GDB_IF_PACKET_DETACH;
+		c = cur->buffer_out[cur->out_ptr++];
+		if (c == 0x04)
+			return GDB_IF_PACKET_DETACH;
+	} while (c != '$');
+
+	while (1) {
+		if (!gdb_if_fill())
+			return GDB_IF_PACKET_DETACH;
+
+		/* Take the run up to the next special character at once */
+		start = &cur->buffer_out[cur->out_ptr];
+		end = &cur->buffer_out[cur->count_out];
+		for (p = start; (p < end) && (*p != '#') && (*p != '$') &&
+		                (*p != '}'); p++);
+		cur->out_ptr += p - start;
+		csum += gdb_if_csum(start, p - start);
+		if (p - start > size - i) {
+			overflow = true;
+			i = size;
+		} else {
+			memcpy(&packet[i], start, p - start);
+			i += p - start;
+		}
+		if (p == end)
+			continue;
+
+		c = cur->buffer_out[cur->out_ptr++];
+		if (c == '#')
+			break;
+		if (c == '$') { /* Restart capture */
+			i = 0;
+			csum = 0;
+			overflow = false;
+			continue;
+		}
+		/* escaped char, may be in the next buffer */
+		if (!gdb_if_fill())
+			return GDB_IF_PACKET_DETACH;
+		c = cur->buffer_out[cur->out_ptr++];
+		csum += c + '}';
+		if (i < size)
+			packet[i++] = c ^ 0x20;
+		else
+			overflow = true;
+	}
+
+	for (int k = 0; k < 2; k++) {
+		if (!gdb_if_fill())
+			return GDB_IF_PACKET_DETACH;
+		recv_csum[k] = cur->buffer_out[cur->out_ptr++];
+	}
+	recv_csum[2] = 0;
+
+	if (overflow || (csum != strtol(recv_csum, NULL, 16)))
+		return GDB_IF_PACKET_BAD;
+	return i;
+}
+
+unsigned char gdb_if_getchar(void)
+{
+	if (!gdb_if_fill())
+		return 0x04;
+
+	return cur->buffer_out[cur->out_ptr++];
 }
 
 unsigned char gdb_if_getchar_to(int timeout)
-{	
+{
 	platform_timeout t;
 	platform_timeout_set(&t, timeout);
 
-	if (!(out_ptr < count_out)) do {
+	if (!(cur->out_ptr < cur->count_out)) do {
 		/* Detach if port closed */
-		if (!getControlLineState(GDB_INTERFACE, CONTROL_LINE_DTR) && !communicationIsBluetoothConnected())
+		if (!gdb_if_connected(cur - links))
 			return 0x04;
 
-		gdb_if_update_buf(TIME_MS2I(1));
-	} while (!platform_timeout_is_expired(&t) && !(out_ptr < count_out));
+		gdb_if_update_buf(timeout ? TIME_MS2I(1) : TIME_IMMEDIATE);
+		/* A zero timeout is a poll, it doesn't wait for the next tick */
+	} while (timeout && !platform_timeout_is_expired(&t) &&
+	         !(cur->out_ptr < cur->count_out));
 
-	if(out_ptr < count_out)
+	if(cur->out_ptr < cur->count_out)
 		return gdb_if_getchar();
 
 	return -1;
 }
-
@@ -0,0 +1,183 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * Copyright (C) 2011  Black Sphere Technologies Ltd.
+ * Written by Gareth McMullin <gareth@blacksphere.co.nz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* This file implements the low-level SW-DP interface for ChibiOS based
+ * platforms.  The sequence functions override the weak per-bit versions
+ * of swdptap_generic.c: they write the GPIO BSRR registers directly and
+ * only switch the SWDIO direction once per sequence.
+ */
+
+#include "general.h"
+#include "swdptap.h"
+
+#define SWDIO_MASK	PAL_PORT_BIT(SWDIO_PIN)
+#define SWCLK_MASK	PAL_PORT_BIT(SWCLK_PIN)
+
+/* BSRR: the low half sets pins, the high half clears them */
+#define SWCLK_HIGH()		(SWCLK_PORT->BSRR.W = SWCLK_MASK)
+#define SWCLK_LOW()		(SWCLK_PORT->BSRR.W = SWCLK_MASK << 16)
+#define SWDIO_READ()		((SWDIO_PORT->IDR >> SWDIO_PIN) & 1)
+/* Present the next data bit and drop SWCLK with a single store,
+ * SWDIO and SWCLK share the same port on this platform. */
+#define SWDIO_OUT_SWCLK_LOW(bit)					\
+	(SWDIO_PORT->BSRR.W = ((bit) ? SWDIO_MASK : SWDIO_MASK << 16) |	\
+	                      (SWCLK_MASK << 16))
+
+/* CPU cycles per SWCLK period at swd_delay_cnt == 0 and per delay loop
+ * iteration, a period holds two delays.  Estimates for -O2 at 168MHz.
+ * UNVERIFIED: neither these nor the SWCLK gain of the kernels below have
+ * been measured on hardware, so the platform starts with a conservative
+ * SWD_DELAY_CNT and "monitor freq" marks its figures as estimated. */
+#ifndef SWD_CYCLES_PER_BIT
+#define SWD_CYCLES_PER_BIT	16
+#endif
+#ifndef SWD_CYCLES_PER_DELAY
+#define SWD_CYCLES_PER_DELAY	8
+#endif
+
+int swd_delay_cnt = SWD_DELAY_CNT;
+
+static uint8_t olddir = 0;
+
+static inline __attribute__((always_inline)) void swd_delay(int cnt)
+{
+	for (volatile int i = cnt; i > 0; i--);
+}
+
+int swdptap_init(void)
+{
+	return 0;
+}
+
+static void swdptap_turnaround(uint8_t dir)
+{
+	/* Don't turnaround if direction not changing */
+	if(dir == olddir) return;
+	olddir = dir;
+
+	if(dir)
+		SWDIO_MODE_FLOAT();
+	SWCLK_HIGH();
+	swd_delay(swd_delay_cnt);
+	SWCLK_LOW();
+	swd_delay(swd_delay_cnt);
+	if(!dir)
+		SWDIO_MODE_DRIVE();
+}
+
+bool swdptap_bit_in(void)
+{
+	return swdptap_seq_in(1);
+}
+
+void swdptap_bit_out(bool val)
+{
+	swdptap_seq_out(val, 1);
+}
+
+/* The kernels below are always inlined with either a constant zero delay,
+ * which leaves a bare store/load sequence per bit for the compiler to
+ * unroll, or with the runtime delay from swd_delay_cnt. */
+static inline __attribute__((always_inline))
+uint32_t seq_in_kernel(int ticks, int delay)
+{
+	uint32_t ret = 0;
+
+	for (int i = 0; i < ticks; i++) {
+		ret |= SWDIO_READ() << i;
+		SWCLK_HIGH();
+		swd_delay(delay);
+		SWCLK_LOW();
+		swd_delay(delay);
+	}
+	return ret;
+}
+
+static inline __attribute__((always_inline))
+void seq_out_kernel(uint32_t MS, int ticks, int delay)
+{
+	while (ticks--) {
+		SWDIO_OUT_SWCLK_LOW(MS & 1);
+		swd_delay(delay);
+		SWCLK_HIGH();
+		swd_delay(delay);
+		MS >>= 1;
+	}
+	SWCLK_LOW();
+}
+
+__attribute__((optimize("unroll-loops")))
+uint32_t swdptap_seq_in(int ticks)
+{
+	swdptap_turnaround(1);
+
+	if (swd_delay_cnt)
+		return seq_in_kernel(ticks, swd_delay_cnt);
+	return seq_in_kernel(ticks, 0);
+}
+
+bool swdptap_seq_in_parity(uint32_t *ret, int ticks)
+{
+	*ret = swdptap_seq_in(ticks);
+	return __builtin_parity(*ret) ^ swdptap_seq_in(1);
+}
+
+__attribute__((optimize("unroll-loops")))
+void swdptap_seq_out(uint32_t MS, int ticks)
+{
+	swdptap_turnaround(0);
+
+	if (swd_delay_cnt)
+		seq_out_kernel(MS, ticks, swd_delay_cnt);
+	else
+		seq_out_kernel(MS, ticks, 0);
+}
+
+void swdptap_seq_out_parity(uint32_t MS, int ticks)
+{
+	uint32_t mask = (ticks < 32) ? (1u << ticks) - 1 : 0xffffffff;
+
+	swdptap_seq_out(MS, ticks);
+	swdptap_seq_out(__builtin_parity(MS & mask), 1);
+}
+
+#ifdef PLATFORM_HAS_FREQUENCY
+void platform_max_frequency_set(uint32_t freq)
+{
+	uint32_t period;
+
+	if (!freq)
+		freq = 1;
+	/* Round the period up so freq is never exceeded */
+	period = (STM32_SYSCLK + freq - 1) / freq;
+	if (period <= SWD_CYCLES_PER_BIT)
+		swd_delay_cnt = 0;
+	else
+		swd_delay_cnt = (period - SWD_CYCLES_PER_BIT +
+		                 2 * SWD_CYCLES_PER_DELAY - 1) /
+		                (2 * SWD_CYCLES_PER_DELAY);
+}
+
+uint32_t platform_max_frequency_get(void)
+{
+	return STM32_SYSCLK / (SWD_CYCLES_PER_BIT +
+	                       2 * SWD_CYCLES_PER_DELAY * swd_delay_cnt);
+}
+#endif
@@ -22,31 +22,9 @@
 #include "ch.h"
 #include "hal.h"
 
-static volatile uint32_t time_ms = 0;;
-
-static THD_WORKING_AREA(sys_tick_thd_wa, 128);
-static THD_FUNCTION(sys_tick_thd, arg)
-{
-	(void) arg;
-
-	chRegSetThreadName("Systick emulation GDB");
-
-	uint8_t state = 0;;
-	while(1){
-		chThdSleepMilliseconds(100);
-		state = !state;
-
-		time_ms += 100;
-
-		//SET_ERROR_STATE(morse_update());
-	}
-}
-
 void platform_timing_init(void)
 {
-	/* Setup heartbeat timer */
-	chThdCreateStatic(sys_tick_thd_wa, sizeof(sys_tick_thd_wa), NORMALPRIO+10, sys_tick_thd, NULL);
-
+	/* Time is read from the ChibiOS system timer, nothing to start */
 }
 
 void platform_delay(uint32_t ms)
@@ -56,6 +34,5 @@ void platform_delay(uint32_t ms)
 
 uint32_t platform_time_ms(void)
 {
-	return time_ms;
+	return TIME_I2MS(chVTGetSystemTimeX());
 }
-
@@ -239,6 +239,71 @@ void adiv5_dp_write(ADIv5_DP_t *dp, uint16_t addr, uint32_t value)
 	dp->low_access(dp, ADIV5_LOW_WRITE, addr, value);
 }
 
+static void adiv5_dp_queue(ADIv5_DP_t *dp, uint8_t RnW, uint16_t addr,
+                           uint32_t value, uint32_t *result)
+{
+	if (dp->queue_count == ADIV5_DP_QUEUE_LEN)
+		adiv5_dp_queue_flush(dp);
+
+	struct adiv5_dp_queue_entry *e = &dp->queue[dp->queue_count++];
+	e->addr = addr;
+	e->RnW = RnW;
+	e->value = value;
+	e->result = result;
+}
+
+void adiv5_dp_queue_write(ADIv5_DP_t *dp, uint16_t addr, uint32_t value)
+{
+	adiv5_dp_queue(dp, ADIV5_LOW_WRITE, addr, value, NULL);
+}
+
+void adiv5_dp_queue_read(ADIv5_DP_t *dp, uint16_t addr, uint32_t *result)
+{
+	adiv5_dp_queue(dp, ADIV5_LOW_READ, addr, 0, result);
+}
+
+/* Send all queued transactions to the DP.
+ * AP reads are posted: the data for one AP read is returned by the next
+ * AP read, so consecutive AP reads are pipelined and RDBUFF is only read
+ * when anything else comes next, or at the end of the queue.
+ */
+void adiv5_dp_queue_run(ADIv5_DP_t *dp)
+{
+	unsigned count = dp->queue_count;
+	uint32_t *pending = NULL;
+
+	/* Empty the queue first, so an exception doesn't leave stale entries */
+	dp->queue_count = 0;
+
+	for (unsigned i = 0; i < count; i++) {
+		struct adiv5_dp_queue_entry *e = &dp->queue[i];
+
+		if (e->RnW && (e->addr & ADIV5_APnDP)) {
+			uint32_t tmp = adiv5_dp_low_access(dp, ADIV5_LOW_READ,
+			                                   e->addr, 0);
+			if (pending)
+				*pending = tmp;
+			pending = e->result;
+			continue;
+		}
+
+		if (pending) {
+			*pending = adiv5_dp_low_access(dp, ADIV5_LOW_READ,
+			                               ADIV5_DP_RDBUFF, 0);
+			pending = NULL;
+		}
+
+		if (e->RnW)
+			*e->result = adiv5_dp_read(dp, e->addr);
+		else
+			adiv5_dp_write(dp, e->addr, e->value);
+	}
+
+	if (pending)
+		*pending = adiv5_dp_low_access(dp, ADIV5_LOW_READ,
+		                               ADIV5_DP_RDBUFF, 0);
+}
+
 static uint32_t adiv5_mem_read32(ADIv5_AP_t *ap, uint32_t addr)
 {
 	uint32_t ret;
@@ -461,6 +526,10 @@ void adiv5_dp_init(ADIv5_DP_t *dp)
 	adiv5_dp_unref(dp);
 }
 
+/* Bits of ADIv5_AP_t shadow_valid */
+#define AP_SHADOW_CSW	(1 << 0)
+#define AP_SHADOW_TAR	(1 << 1)
+
 enum align {
 	ALIGN_BYTE =  0,
 	ALIGN_HALFWORD = 1,
@@ -469,10 +538,14 @@ enum align {
 #define ALIGNOF(x) (((x) & 3) == 0 ? ALIGN_WORD : \
                     (((x) & 1) == 0 ? ALIGN_HALFWORD : ALIGN_BYTE))
 
-/* Program the CSW and TAR for sequencial access at a given width */
-static void ap_mem_access_setup(ADIv5_AP_t *ap, uint32_t addr, enum align align)
+/* Program the CSW and TAR for count accesses at a given width.  A single
+ * access leaves TAR where it is, so polling a register costs neither a
+ * CSW nor a TAR write after the first read. */
+static void ap_mem_access_setup(ADIv5_AP_t *ap, uint32_t addr, enum align align,
+                                size_t count)
 {
-	uint32_t csw = ap->csw | ADIV5_AP_CSW_ADDRINC_SINGLE;
+	uint32_t csw = ap->csw | ((count > 1) ? ADIV5_AP_CSW_ADDRINC_SINGLE :
+	                                        ADIV5_AP_CSW_ADDRINC_NONE);
 
 	switch (align) {
 	case ALIGN_BYTE:
@@ -486,7 +559,10 @@ static void ap_mem_access_setup(ADIv5_AP_t *ap, uint32_t addr, enum align align)
 		break;
 	}
 	adiv5_ap_write(ap, ADIV5_AP_CSW, csw);
-	adiv5_dp_low_access(ap->dp, ADIV5_LOW_WRITE, ADIV5_AP_TAR, addr);
+	adiv5_ap_write(ap, ADIV5_AP_TAR, addr);
+	/* From here on TAR follows the transfers */
+	if (count > 1)
+		ap->shadow_valid &= ~AP_SHADOW_TAR;
 }
 
 /* Extract read data from data lane based on align and src address */
@@ -509,7 +585,7 @@ static void * extract(void *dest, uint32_t src, uint32_t val, enum align align)
 void
 adiv5_mem_read(ADIv5_AP_t *ap, void *dest, uint32_t src, size_t len)
 {
-	uint32_t tmp;
+	uint32_t data[ADIV5_DP_QUEUE_LEN];
 	uint32_t osrc = src;
 	enum align align = MIN(ALIGNOF(src), ALIGNOF(len));
 
@@ -517,24 +593,28 @@ adiv5_mem_read(ADIv5_AP_t *ap, void *dest, uint32_t src, size_t len)
 		return;
 
 	len >>= align;
-	ap_mem_access_setup(ap, src, align);
-	adiv5_dp_low_access(ap->dp, ADIV5_LOW_READ, ADIV5_AP_DRW, 0);
-	while (--len) {
-		tmp = adiv5_dp_low_access(ap->dp, ADIV5_LOW_READ, ADIV5_AP_DRW, 0);
-		dest = extract(dest, src, tmp, align);
+	ap_mem_access_setup(ap, src, align, len);
+	while (len) {
+		size_t count = MIN(len, ADIV5_DP_QUEUE_LEN);
+		uint32_t addr = src;
+
+		for (size_t i = 0; i < count; i++) {
+			/* Check for 10 bit address overflow */
+			if ((addr ^ osrc) & 0xfffffc00) {
+				osrc = addr;
+				adiv5_dp_queue_write(ap->dp, ADIV5_AP_TAR, addr);
+			}
+			adiv5_dp_queue_read(ap->dp, ADIV5_AP_DRW, &data[i]);
+			addr += (1 << align);
+		}
+		adiv5_dp_queue_flush(ap->dp);
 
-		src += (1 << align);
-		/* Check for 10 bit address overflow */
-		if ((src ^ osrc) & 0xfffffc00) {
-			osrc = src;
-			adiv5_dp_low_access(ap->dp,
-					ADIV5_LOW_WRITE, ADIV5_AP_TAR, src);
-			adiv5_dp_low_access(ap->dp,
-					ADIV5_LOW_READ, ADIV5_AP_DRW, 0);
+		for (size_t i = 0; i < count; i++) {
+			dest = extract(dest, src, data[i], align);
+			src += (1 << align);
 		}
+		len -= count;
 	}
-	tmp = adiv5_dp_low_access(ap->dp, ADIV5_LOW_READ, ADIV5_DP_RDBUFF, 0);
-	extract(dest, src, tmp, align);
 }
 
 void
@@ -544,7 +624,7 @@ adiv5_mem_write(ADIv5_AP_t *ap, uint32_t dest, const void *src, size_t len)
 	enum align align = MIN(ALIGNOF(dest), ALIGNOF(len));
 
 	len >>= align;
-	ap_mem_access_setup(ap, dest, align);
+	ap_mem_access_setup(ap, dest, align, len);
 	while (len--) {
 		uint32_t tmp = 0;
 		/* Pack data into correct data lane */
@@ -561,29 +641,81 @@ adiv5_mem_write(ADIv5_AP_t *ap, uint32_t dest, const void *src, size_t len)
 		}
 		src = (uint8_t *)src + (1 << align);
 		dest += (1 << align);
-		adiv5_dp_low_access(ap->dp, ADIV5_LOW_WRITE, ADIV5_AP_DRW, tmp);
+		adiv5_dp_queue_write(ap->dp, ADIV5_AP_DRW, tmp);
 
 		/* Check for 10 bit address overflow */
 		if ((dest ^ odest) & 0xfffffc00) {
 			odest = dest;
-			adiv5_dp_low_access(ap->dp,
-					ADIV5_LOW_WRITE, ADIV5_AP_TAR, dest);
+			adiv5_dp_queue_write(ap->dp, ADIV5_AP_TAR, dest);
 		}
 	}
+	adiv5_dp_queue_flush(ap->dp);
+}
+
+static void adiv5_dp_select(ADIv5_DP_t *dp, uint32_t select)
+{
+	if (dp->select_valid && (dp->select == select))
+		return;
+	/* Not valid until the write has gone through */
+	dp->select_valid = false;
+	adiv5_dp_write(dp, ADIV5_DP_SELECT, select);
+	dp->select = select;
+	dp->select_valid = true;
+}
+
+static uint8_t ap_shadow_valid(ADIv5_AP_t *ap)
+{
+	if (ap->shadow_gen != ap->dp->shadow_gen) {
+		ap->shadow_gen = ap->dp->shadow_gen;
+		ap->shadow_valid = 0;
+	}
+	return ap->shadow_valid;
+}
+
+/* A DRW access moves TAR on unless we know CSW doesn't increment */
+static void ap_drw_access(ADIv5_AP_t *ap, uint16_t addr)
+{
+	if ((addr == ADIV5_AP_DRW) &&
+	    (!(ap_shadow_valid(ap) & AP_SHADOW_CSW) ||
+	     (ap->csw_shadow & ADIV5_AP_CSW_ADDRINC_MASK)))
+		ap->shadow_valid &= ~AP_SHADOW_TAR;
 }
 
 void adiv5_ap_write(ADIv5_AP_t *ap, uint16_t addr, uint32_t value)
 {
-	adiv5_dp_write(ap->dp, ADIV5_DP_SELECT,
-			((uint32_t)ap->apsel << 24)|(addr & 0xF0));
+	uint8_t valid;
+
+	adiv5_dp_select(ap->dp, ((uint32_t)ap->apsel << 24)|(addr & 0xF0));
+
+	/* Skip CSW and TAR writes that wouldn't change anything */
+	valid = ap_shadow_valid(ap);
+	if (addr == ADIV5_AP_CSW) {
+		if ((valid & AP_SHADOW_CSW) && (ap->csw_shadow == value))
+			return;
+		ap->shadow_valid &= ~AP_SHADOW_CSW;
+	} else if (addr == ADIV5_AP_TAR) {
+		if ((valid & AP_SHADOW_TAR) && (ap->tar_shadow == value))
+			return;
+		ap->shadow_valid &= ~AP_SHADOW_TAR;
+	}
+	ap_drw_access(ap, addr);
+
 	adiv5_dp_write(ap->dp, addr, value);
+
+	if (addr == ADIV5_AP_CSW) {
+		ap->csw_shadow = value;
+		ap->shadow_valid |= AP_SHADOW_CSW;
+	} else if (addr == ADIV5_AP_TAR) {
+		ap->tar_shadow = value;
+		ap->shadow_valid |= AP_SHADOW_TAR;
+	}
 }
 
 uint32_t adiv5_ap_read(ADIv5_AP_t *ap, uint16_t addr)
 {
 	uint32_t ret;
-	adiv5_dp_write(ap->dp, ADIV5_DP_SELECT,
-			((uint32_t)ap->apsel << 24)|(addr & 0xF0));
+	adiv5_dp_select(ap->dp, ((uint32_t)ap->apsel << 24)|(addr & 0xF0));
+	ap_drw_access(ap, addr);
 	ret = adiv5_dp_read(ap->dp, addr);
 	return ret;
 }
@@ -100,6 +100,16 @@
 #define ADIV5_LOW_WRITE		0
 #define ADIV5_LOW_READ		1
 
+/* Number of transactions a DP can hold before a queue flush is forced */
+#define ADIV5_DP_QUEUE_LEN	32
+
+struct adiv5_dp_queue_entry {
+	uint16_t addr;
+	uint8_t RnW;
+	uint32_t value;
+	uint32_t *result;
+};
+
 /* Try to keep this somewhat absract for later adding SW-DP */
 typedef struct ADIv5_DP_s {
 	int refcnt;
@@ -111,13 +121,30 @@ typedef struct ADIv5_DP_s {
 	uint32_t (*low_access)(struct ADIv5_DP_s *dp, uint8_t RnW,
                                uint16_t addr, uint32_t value);
 	void (*abort)(struct ADIv5_DP_s *dp, uint32_t abort);
+	void (*queue_flush)(struct ADIv5_DP_s *dp);
+
+	jtag_dev_t *dev;
+	/* SW-DP only, set on a FAULT ack until the error is cleared */
+	uint8_t fault;
 
-	union {
-		jtag_dev_t *dev;
-		uint8_t fault;
-	};
+	/* Transactions posted with adiv5_dp_queue_*() and not yet sent */
+	struct adiv5_dp_queue_entry queue[ADIV5_DP_QUEUE_LEN];
+	unsigned queue_count;
+
+	/* Last value written to SELECT, so unchanged ones can be skipped.
+	 * Bumping shadow_gen drops the CSW/TAR shadows of all our APs. */
+	uint32_t select;
+	bool select_valid;
+	unsigned shadow_gen;
 } ADIv5_DP_t;
 
+/* After a fault or an abort we can't tell what reached the DP */
+static inline void adiv5_dp_shadow_invalidate(ADIv5_DP_t *dp)
+{
+	dp->select_valid = false;
+	dp->shadow_gen++;
+}
+
 static inline uint32_t adiv5_dp_read(ADIv5_DP_t *dp, uint16_t addr)
 {
 	return dp->dp_read(dp, addr);
@@ -125,6 +152,7 @@ static inline uint32_t adiv5_dp_read(ADIv5_DP_t *dp, uint16_t addr)
 
 static inline uint32_t adiv5_dp_error(ADIv5_DP_t *dp)
 {
+	adiv5_dp_shadow_invalidate(dp);
 	return dp->error(dp);
 }
 
@@ -136,9 +164,15 @@ static inline uint32_t adiv5_dp_low_access(struct ADIv5_DP_s *dp, uint8_t RnW,
 
 static inline void adiv5_dp_abort(struct ADIv5_DP_s *dp, uint32_t abort)
 {
+	adiv5_dp_shadow_invalidate(dp);
 	return dp->abort(dp, abort);
 }
 
+static inline void adiv5_dp_queue_flush(struct ADIv5_DP_s *dp)
+{
+	dp->queue_flush(dp);
+}
+
 typedef struct ADIv5_AP_s {
 	int refcnt;
 
@@ -149,11 +183,23 @@ typedef struct ADIv5_AP_s {
 	uint32_t cfg;
 	uint32_t base;
 	uint32_t csw;
+
+	/* Last CSW and TAR written, valid while shadow_gen matches the DP */
+	uint32_t csw_shadow;
+	uint32_t tar_shadow;
+	uint8_t shadow_valid;
+	unsigned shadow_gen;
 } ADIv5_AP_t;
 
 void adiv5_dp_init(ADIv5_DP_t *dp);
 void adiv5_dp_write(ADIv5_DP_t *dp, uint16_t addr, uint32_t value);
 
+/* Queued DP/AP access.  Results of queued reads are only valid once
+ * adiv5_dp_queue_flush() has returned. */
+void adiv5_dp_queue_write(ADIv5_DP_t *dp, uint16_t addr, uint32_t value);
+void adiv5_dp_queue_read(ADIv5_DP_t *dp, uint16_t addr, uint32_t *result);
+void adiv5_dp_queue_run(ADIv5_DP_t *dp);
+
 ADIv5_AP_t *adiv5_new_ap(ADIv5_DP_t *dp, uint8_t apsel);
 void adiv5_dp_ref(ADIv5_DP_t *dp);
 void adiv5_ap_ref(ADIv5_AP_t *ap);
@@ -37,6 +37,9 @@
 #define IR_DPACC	0xA
 #define IR_APACC	0xB
 
+#define JTAGDP_CTRLSTAT_PWRUP \
+	(ADIV5_DP_CTRLSTAT_CSYSPWRUPREQ | ADIV5_DP_CTRLSTAT_CDBGPWRUPREQ)
+
 static uint32_t adiv5_jtagdp_read(ADIv5_DP_t *dp, uint16_t addr);
 
 static uint32_t adiv5_jtagdp_error(ADIv5_DP_t *dp);
@@ -46,6 +49,8 @@ static uint32_t adiv5_jtagdp_low_access(ADIv5_DP_t *dp, uint8_t RnW,
 
 static void adiv5_jtagdp_abort(ADIv5_DP_t *dp, uint32_t abort);
 
+static void adiv5_jtagdp_queue_flush(ADIv5_DP_t *dp);
+
 void adiv5_jtag_dp_handler(jtag_dev_t *dev)
 {
 	ADIv5_DP_t *dp = (void*)calloc(1, sizeof(*dp));
@@ -57,15 +62,63 @@ void adiv5_jtag_dp_handler(jtag_dev_t *dev)
 	dp->error = adiv5_jtagdp_error;
 	dp->low_access = adiv5_jtagdp_low_access;
 	dp->abort = adiv5_jtagdp_abort;
+	dp->queue_flush = adiv5_jtagdp_queue_flush;
 
 	adiv5_dp_init(dp);
 }
 
+/* Queue a DPACC/APACC scan, the response is only valid once
+ * jtagtap_sync() has returned. */
+static void adiv5_jtagdp_scan(ADIv5_DP_t *dp, uint8_t RnW, uint16_t addr,
+                              uint32_t value, uint64_t *response)
+{
+	bool APnDP = addr & ADIV5_APnDP;
+	addr &= 0xff;
+	uint64_t request;
+
+	request = ((uint64_t)value << 3) | ((addr >> 1) & 0x06) | (RnW?1:0);
+	*response = 0;
+
+	jtag_dev_write_ir(dp->dev, APnDP ? IR_APACC : IR_DPACC);
+	jtag_dev_shift_dr_deferred(dp->dev, (uint8_t*)response,
+	                           (uint8_t*)&request, 35);
+}
+
+static uint32_t adiv5_jtagdp_ack(uint64_t response)
+{
+	uint8_t ack = response & 0x07;
+
+	if (ack == JTAGDP_ACK_WAIT)
+		raise_exception(EXCEPTION_TIMEOUT, "JTAG-DP ACK timeout");
+
+	if((ack != JTAGDP_ACK_OK))
+		raise_exception(EXCEPTION_ERROR, "JTAG-DP invalid ACK");
+
+	return (uint32_t)(response >> 3);
+}
+
+/* The read and the RDBUFF scan that returns its data are sent in one
+ * go.  Reading RDBUFF has no side effects, so if the read had to wait
+ * the pair is simply sent again. */
 static uint32_t adiv5_jtagdp_read(ADIv5_DP_t *dp, uint16_t addr)
 {
-	adiv5_jtagdp_low_access(dp, ADIV5_LOW_READ, addr, 0);
-	return adiv5_jtagdp_low_access(dp, ADIV5_LOW_READ,
-					ADIV5_DP_RDBUFF, 0);
+	uint64_t response, rdbuff;
+	platform_timeout timeout;
+
+	platform_timeout_set(&timeout, 2000);
+	do {
+		adiv5_jtagdp_scan(dp, ADIV5_LOW_READ, addr, 0, &response);
+		adiv5_jtagdp_scan(dp, ADIV5_LOW_READ, ADIV5_DP_RDBUFF, 0,
+		                  &rdbuff);
+		jtagtap_sync();
+	} while(!platform_timeout_is_expired(&timeout) &&
+	        ((response & 0x07) == JTAGDP_ACK_WAIT));
+
+	adiv5_jtagdp_ack(response);
+	if ((rdbuff & 0x07) == JTAGDP_ACK_WAIT)
+		return adiv5_jtagdp_low_access(dp, ADIV5_LOW_READ,
+		                               ADIV5_DP_RDBUFF, 0);
+	return adiv5_jtagdp_ack(rdbuff);
 }
 
 static uint32_t adiv5_jtagdp_error(ADIv5_DP_t *dp)
@@ -78,29 +131,17 @@ static uint32_t adiv5_jtagdp_error(ADIv5_DP_t *dp)
 static uint32_t adiv5_jtagdp_low_access(ADIv5_DP_t *dp, uint8_t RnW,
 					uint16_t addr, uint32_t value)
 {
-	bool APnDP = addr & ADIV5_APnDP;
-	addr &= 0xff;
-	uint64_t request, response;
-	uint8_t ack;
+	uint64_t response;
 	platform_timeout timeout;
 
-	request = ((uint64_t)value << 3) | ((addr >> 1) & 0x06) | (RnW?1:0);
-
-	jtag_dev_write_ir(dp->dev, APnDP ? IR_APACC : IR_DPACC);
-
 	platform_timeout_set(&timeout, 2000);
 	do {
-		jtag_dev_shift_dr(dp->dev, (uint8_t*)&response, (uint8_t*)&request, 35);
-		ack = response & 0x07;
-	} while(!platform_timeout_is_expired(&timeout) && (ack == JTAGDP_ACK_WAIT));
+		adiv5_jtagdp_scan(dp, RnW, addr, value, &response);
+		jtagtap_sync();
+	} while(!platform_timeout_is_expired(&timeout) &&
+	        ((response & 0x07) == JTAGDP_ACK_WAIT));
 
-	if (ack == JTAGDP_ACK_WAIT)
-		raise_exception(EXCEPTION_TIMEOUT, "JTAG-DP ACK timeout");
-
-	if((ack != JTAGDP_ACK_OK))
-		raise_exception(EXCEPTION_ERROR, "JTAG-DP invalid ACK");
-
-	return (uint32_t)(response >> 3);
+	return adiv5_jtagdp_ack(response);
 }
 
 static void adiv5_jtagdp_abort(ADIv5_DP_t *dp, uint32_t abort)
@@ -110,3 +151,106 @@ static void adiv5_jtagdp_abort(ADIv5_DP_t *dp, uint32_t abort)
 	jtag_dev_shift_dr(dp->dev, NULL, (const uint8_t*)&request, 35);
 }
 
+/* Clear STICKYORUN and turn overrun detection off */
+static void adiv5_jtagdp_orun_clear(ADIv5_DP_t *dp)
+{
+	adiv5_jtagdp_low_access(dp, ADIV5_LOW_WRITE, ADIV5_DP_CTRLSTAT,
+	                        JTAGDP_CTRLSTAT_PWRUP |
+	                        ADIV5_DP_CTRLSTAT_STICKYORUN);
+}
+
+/* Send a queue of AP accesses as one batch of scans with a single
+ * jtagtap_sync().  Overrun detection is on for the batch: after a WAIT
+ * the DP sets STICKYORUN and drops the AP accesses that follow, instead
+ * of carrying on with the queue out of order.  The result of each scan
+ * comes back with the next one, a trailing RDBUFF read collects the last
+ * one, and the final CTRL/STAT write clears STICKYORUN and turns
+ * detection off again.  Everything from the first WAIT on is then sent
+ * again one access at a time.
+ */
+static void adiv5_jtagdp_queue_flush(ADIv5_DP_t *dp)
+{
+	unsigned count = dp->queue_count;
+	uint64_t response[ADIV5_DP_QUEUE_LEN + 3];
+	unsigned wait = count + 3;	/* First scan that got WAIT */
+	unsigned done;			/* Entries that went through */
+
+	/* A DP access would still go through after an overrun */
+	for (unsigned i = 0; i < count; i++) {
+		if (!(dp->queue[i].addr & ADIV5_APnDP)) {
+			adiv5_dp_queue_run(dp);
+			return;
+		}
+	}
+	if (!count)
+		return;
+	dp->queue_count = 0;
+
+	adiv5_jtagdp_scan(dp, ADIV5_LOW_WRITE, ADIV5_DP_CTRLSTAT,
+	                  JTAGDP_CTRLSTAT_PWRUP | ADIV5_DP_CTRLSTAT_ORUNDETECT,
+	                  &response[0]);
+	for (unsigned i = 0; i < count; i++) {
+		struct adiv5_dp_queue_entry *e = &dp->queue[i];
+		adiv5_jtagdp_scan(dp, e->RnW, e->addr, e->value,
+		                  &response[i + 1]);
+	}
+	adiv5_jtagdp_scan(dp, ADIV5_LOW_READ, ADIV5_DP_RDBUFF, 0,
+	                  &response[count + 1]);
+	adiv5_jtagdp_scan(dp, ADIV5_LOW_WRITE, ADIV5_DP_CTRLSTAT,
+	                  JTAGDP_CTRLSTAT_PWRUP | ADIV5_DP_CTRLSTAT_STICKYORUN,
+	                  &response[count + 2]);
+	jtagtap_sync();
+
+	for (unsigned i = 0; i < count + 3; i++) {
+		uint8_t ack = response[i] & 0x07;
+		if ((ack == JTAGDP_ACK_WAIT) && (wait == count + 3))
+			wait = i;
+		else if ((ack != JTAGDP_ACK_WAIT) && (ack != JTAGDP_ACK_OK))
+			raise_exception(EXCEPTION_ERROR, "JTAG-DP invalid ACK");
+	}
+
+	/* Read results captured before the first WAIT are good */
+	for (unsigned i = 0; i < count; i++) {
+		struct adiv5_dp_queue_entry *e = &dp->queue[i];
+		if (e->RnW && (i + 2 < wait))
+			*e->result = response[i + 2] >> 3;
+	}
+	if (wait == count + 3)
+		return;
+
+	if (wait == 0) {
+		/* Detection never got turned on, so a later WAIT may have
+		 * let the rest of the queue through out of order. */
+		for (unsigned i = 1; i < count + 3; i++) {
+			if ((response[i] & 0x07) == JTAGDP_ACK_WAIT) {
+				adiv5_jtagdp_orun_clear(dp);
+				raise_exception(EXCEPTION_ERROR,
+				                "JTAG-DP overrun");
+			}
+		}
+		return;
+	}
+
+	/* The access before the first WAIT went through, but its result
+	 * is only in the RDBUFF read, if that didn't have to wait too.
+	 * Before the CTRL/STAT write it can still be read again. */
+	done = MIN(wait - 1, count);
+	if (done && dp->queue[done - 1].RnW && (done + 1 >= wait)) {
+		struct adiv5_dp_queue_entry *e = &dp->queue[done - 1];
+		if ((wait <= count) &&
+		    ((response[count + 1] & 0x07) == JTAGDP_ACK_OK))
+			*e->result = response[count + 1] >> 3;
+		else if ((response[count + 2] & 0x07) == JTAGDP_ACK_WAIT)
+			*e->result = adiv5_jtagdp_low_access(dp,
+			                   ADIV5_LOW_READ, ADIV5_DP_RDBUFF, 0);
+		else
+			raise_exception(EXCEPTION_TIMEOUT, "JTAG-DP overrun");
+	}
+	if ((response[count + 2] & 0x07) != JTAGDP_ACK_OK)
+		adiv5_jtagdp_orun_clear(dp);
+
+	memmove(dp->queue, &dp->queue[done],
+	        (count - done) * sizeof(dp->queue[0]));
+	dp->queue_count = count - done;
+	adiv5_dp_queue_run(dp);
+}
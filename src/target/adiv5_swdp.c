@@ -42,14 +42,24 @@ static uint32_t adiv5_swdp_low_access(ADIv5_DP_t *dp, uint8_t RnW,
 
 static void adiv5_swdp_abort(ADIv5_DP_t *dp, uint32_t abort);
 
-int adiv5_swdp_scan(void)
-{
-	uint8_t ack;
+static void adiv5_swdp_queue_flush(ADIv5_DP_t *dp);
 
-	target_list_free();
-	ADIv5_DP_t *dp = (void*)calloc(1, sizeof(*dp));
+/* Set while a queue is being sent, transactions then follow each other
+ * without the trailing idle cycles. */
+static bool swdp_queue_running;
 
-	swdptap_init();
+#ifdef PLATFORM_HAS_FREQUENCY
+/* Clock rate auto-tuning starts from here on each scan, 0 disables it */
+uint32_t swdp_autotune_freq;
+
+#define SWDP_AUTOTUNE_READS	32
+#define SWDP_AUTOTUNE_MIN_FREQ	10000
+#endif
+
+/* Switch from JTAG to SWD mode and read IDCODE to synchronise */
+static bool adiv5_swdp_connect(uint32_t *idcode)
+{
+	uint8_t ack;
 
 	/* Switch from JTAG to SWD mode */
 	swdptap_seq_out(0xFFFF, 16);
@@ -65,7 +75,68 @@ int adiv5_swdp_scan(void)
 	 * allow the ack to be checked here. */
 	swdptap_seq_out(0xA5, 8);
 	ack = swdptap_seq_in(3);
-	if((ack != SWDP_ACK_OK) || swdptap_seq_in_parity(&dp->idcode, 32)) {
+	if((ack != SWDP_ACK_OK) || swdptap_seq_in_parity(idcode, 32))
+		return false;
+	swdptap_seq_out(0, 8);
+	return true;
+}
+
+#ifdef PLATFORM_HAS_FREQUENCY
+/* Read IDCODE back to back, the link is usable at the current clock
+ * rate if every read gets an OK ack, good parity and the same value. */
+static bool adiv5_swdp_link_ok(uint32_t idcode)
+{
+	uint32_t val;
+
+	for (int i = 0; i < SWDP_AUTOTUNE_READS; i++) {
+		swdptap_seq_out(0xA5, 8);
+		if (swdptap_seq_in(3) != SWDP_ACK_OK)
+			return false;
+		if (swdptap_seq_in_parity(&val, 32) || (val != idcode))
+			return false;
+	}
+	swdptap_seq_out(0, 8);
+	return true;
+}
+
+/* Halve the clock rate from swdp_autotune_freq until IDCODE reads
+ * are clean, or the platform can't go any slower. */
+static bool adiv5_swdp_autotune(uint32_t *idcode)
+{
+	uint32_t freq = swdp_autotune_freq, last = 0;
+
+	while (freq >= SWDP_AUTOTUNE_MIN_FREQ) {
+		platform_max_frequency_set(freq);
+		freq = platform_max_frequency_get();
+		if (freq == last)
+			break;
+		last = freq;
+		if (adiv5_swdp_connect(idcode) && adiv5_swdp_link_ok(*idcode)) {
+			DEBUG("SW-DP clock tuned to %"PRIu32" Hz\n", freq);
+			return true;
+		}
+		freq /= 2;
+	}
+	return false;
+}
+#endif
+
+int adiv5_swdp_scan(void)
+{
+	bool connected;
+
+	target_list_free();
+	ADIv5_DP_t *dp = (void*)calloc(1, sizeof(*dp));
+
+	swdptap_init();
+
+#ifdef PLATFORM_HAS_FREQUENCY
+	if (swdp_autotune_freq)
+		connected = adiv5_swdp_autotune(&dp->idcode);
+	else
+#endif
+		connected = adiv5_swdp_connect(&dp->idcode);
+	if (!connected) {
 		DEBUG("\n");
 		free(dp);
 		return -1;
@@ -75,8 +146,15 @@ int adiv5_swdp_scan(void)
 	dp->error = adiv5_swdp_error;
 	dp->low_access = adiv5_swdp_low_access;
 	dp->abort = adiv5_swdp_abort;
+	dp->queue_flush = adiv5_swdp_queue_flush;
 
 	adiv5_swdp_error(dp);
+#ifdef PLATFORM_HAS_SWD_TRANSFER
+	/* Every transaction has a data phase from here on, which lets
+	 * writes go out without waiting for their ack. */
+	adiv5_swdp_low_access(dp, ADIV5_LOW_WRITE, ADIV5_DP_CTRLSTAT,
+	                      ADIV5_DP_CTRLSTAT_ORUNDETECT);
+#endif
 	adiv5_dp_init(dp);
 
 	return target_list?1:0;
@@ -112,21 +190,15 @@ static uint32_t adiv5_swdp_error(ADIv5_DP_t *dp)
 
 	adiv5_dp_write(dp, ADIV5_DP_ABORT, clr);
 	dp->fault = 0;
+	adiv5_dp_shadow_invalidate(dp);
 
 	return err;
 }
 
-static uint32_t adiv5_swdp_low_access(ADIv5_DP_t *dp, uint8_t RnW,
-				      uint16_t addr, uint32_t value)
+static uint8_t adiv5_swdp_request(uint8_t RnW, uint16_t addr)
 {
 	bool APnDP = addr & ADIV5_APnDP;
-	addr &= 0xff;
 	uint8_t request = 0x81;
-	uint32_t response = 0;
-	uint8_t ack;
-	platform_timeout timeout;
-
-	if(APnDP && dp->fault) return 0;
 
 	if(APnDP) request ^= 0x22;
 	if(RnW)   request ^= 0x24;
@@ -136,36 +208,207 @@ static uint32_t adiv5_swdp_low_access(ADIv5_DP_t *dp, uint8_t RnW,
 	if((addr == 4) || (addr == 8))
 		request ^= 0x20;
 
-	platform_timeout_set(&timeout, 2000);
-	do {
-		swdptap_seq_out(request, 8);
-		ack = swdptap_seq_in(3);
-	} while (!platform_timeout_is_expired(&timeout) && ack == SWDP_ACK_WAIT);
+	return request;
+}
+
+#ifdef PLATFORM_HAS_SWD_TRANSFER
+/* With CTRL/STAT.ORUNDETECT set the data phase follows every ack, so a
+ * read is a single exchange.  A WAIT leaves STICKYORUN set, which is
+ * cleared before the transaction is sent again. */
+static uint8_t adiv5_swdp_orun_access(uint8_t request, uint8_t RnW,
+                                      uint32_t *data)
+{
+	uint8_t ack;
+	bool parity_error = false;
+	bool waiting = false;
+	platform_timeout timeout;
+
+	while (1) {
+		if (RnW) {
+			ack = swdptap_read(request, data, &parity_error);
+		} else {
+			swdptap_seq_out(request, 8);
+			ack = swdptap_seq_in(3);
+			swdptap_seq_out_parity(*data, 32);
+		}
+		if (ack != SWDP_ACK_WAIT)
+			break;
+
+		swdptap_write(adiv5_swdp_request(ADIV5_LOW_WRITE, ADIV5_DP_ABORT),
+		              ADIV5_DP_ABORT_ORUNERRCLR, NULL);
+		/* Only start the clock once the target asks us to wait */
+		if (!waiting) {
+			platform_timeout_set(&timeout, 2000);
+			waiting = true;
+		} else if (platform_timeout_is_expired(&timeout)) {
+			break;
+		}
+	}
+
+	if ((ack == SWDP_ACK_OK) && parity_error)
+		raise_exception(EXCEPTION_ERROR, "SWDP Parity error");
+
+	return ack;
+}
+#endif
+
+static uint32_t adiv5_swdp_low_access(ADIv5_DP_t *dp, uint8_t RnW,
+				      uint16_t addr, uint32_t value)
+{
+	bool APnDP = addr & ADIV5_APnDP;
+	uint8_t request = adiv5_swdp_request(RnW, addr);
+	uint32_t response = 0;
+	uint8_t ack;
+#ifndef PLATFORM_HAS_SWD_TRANSFER
+	platform_timeout timeout;
+#endif
+
+	if(APnDP && dp->fault) return 0;
+
+#ifdef PLATFORM_HAS_SWD_TRANSFER
+	ack = adiv5_swdp_orun_access(request, RnW, RnW ? &response : &value);
+#else
+	swdptap_seq_out(request, 8);
+	ack = swdptap_seq_in(3);
+	if (ack == SWDP_ACK_WAIT) {
+		/* Only start the clock once the target asks us to wait */
+		platform_timeout_set(&timeout, 2000);
+		do {
+			swdptap_seq_out(request, 8);
+			ack = swdptap_seq_in(3);
+		} while (!platform_timeout_is_expired(&timeout) &&
+		         ack == SWDP_ACK_WAIT);
+	}
+#endif
 
 	if (ack == SWDP_ACK_WAIT)
 		raise_exception(EXCEPTION_TIMEOUT, "SWDP ACK timeout");
 
 	if(ack == SWDP_ACK_FAULT) {
 		dp->fault = 1;
+		adiv5_dp_shadow_invalidate(dp);
 		return 0;
 	}
 
 	if(ack != SWDP_ACK_OK)
 		raise_exception(EXCEPTION_ERROR, "SWDP invalid ACK");
 
+#ifndef PLATFORM_HAS_SWD_TRANSFER
 	if(RnW) {
 		if(swdptap_seq_in_parity(&response, 32))  /* Give up on parity error */
 			raise_exception(EXCEPTION_ERROR, "SWDP Parity error");
 	} else {
 		swdptap_seq_out_parity(value, 32);
 	}
+#endif
 
-	/* REMOVE THIS */
-	swdptap_seq_out(0, 8);
+	/* Idle cycles to clock the transaction through the SW-DP.
+	 * A queue only needs them once, after its last transaction. */
+	if (!swdp_queue_running)
+		swdptap_seq_out(0, 8);
 
 	return response;
 }
 
+#ifdef PLATFORM_HAS_SWD_TRANSFER
+/* Send the queue with the acks of writes only collected by the next
+ * read, so only reads wait for the target.  After a WAIT or FAULT the
+ * sticky flag makes the DP refuse everything that follows, so the queue
+ * is sent again one transaction at a time from the first refused one.
+ */
+static void adiv5_swdp_queue_batch(ADIv5_DP_t *dp)
+{
+	unsigned count = dp->queue_count;
+	uint8_t acks[ADIV5_DP_QUEUE_LEN];
+	uint32_t *pending = NULL;
+	uint8_t ack = SWDP_ACK_OK;
+	unsigned i, done = 0;
+
+	/* DP reads don't fit the posted read pipelining below */
+	for (i = 0; i < count; i++)
+		if (dp->queue[i].RnW && !(dp->queue[i].addr & ADIV5_APnDP))
+			break;
+	if (dp->fault || (i < count)) {
+		adiv5_dp_queue_run(dp);
+		return;
+	}
+
+	dp->queue_count = 0;
+
+	/* The final RDBUFF read collects the last AP read and write acks */
+	for (i = 0; i <= count; i++) {
+		struct adiv5_dp_queue_entry *e = &dp->queue[i];
+		uint16_t addr = (i < count) ? e->addr : ADIV5_DP_RDBUFF;
+		bool parity_error;
+		uint32_t data;
+
+		if ((i < count) && !e->RnW) {
+			swdptap_write(adiv5_swdp_request(ADIV5_LOW_WRITE, addr),
+			              e->value, &acks[i]);
+			continue;
+		}
+
+		ack = swdptap_read(adiv5_swdp_request(ADIV5_LOW_READ, addr),
+		                   &data, &parity_error);
+		while ((done < i) && (acks[done] == SWDP_ACK_OK))
+			done++;
+		if ((done < i) || (ack != SWDP_ACK_OK))
+			break;
+		if (parity_error)
+			raise_exception(EXCEPTION_ERROR, "SWDP Parity error");
+
+		if (pending)
+			*pending = data;
+		pending = (i < count) ? e->result : NULL;
+		done = i + 1;
+	}
+	if (i > count)
+		return;
+
+	/* Transactions before done went through, the one at done didn't */
+	if (done < i)
+		ack = acks[done];
+	if (ack == SWDP_ACK_WAIT) {
+		swdptap_write(adiv5_swdp_request(ADIV5_LOW_WRITE, ADIV5_DP_ABORT),
+		              ADIV5_DP_ABORT_ORUNERRCLR, NULL);
+	} else if (ack == SWDP_ACK_FAULT) {
+		dp->fault = 1;
+		adiv5_dp_shadow_invalidate(dp);
+	} else {
+		raise_exception(EXCEPTION_ERROR, "SWDP invalid ACK");
+	}
+
+	if (pending)
+		*pending = adiv5_swdp_low_access(dp, ADIV5_LOW_READ,
+		                                 ADIV5_DP_RDBUFF, 0);
+	if (done < count) {
+		memmove(dp->queue, &dp->queue[done],
+		        (count - done) * sizeof(dp->queue[0]));
+		dp->queue_count = count - done;
+		adiv5_dp_queue_run(dp);
+	}
+}
+#endif
+
+static void adiv5_swdp_queue_flush(ADIv5_DP_t *dp)
+{
+	volatile struct exception e;
+
+	swdp_queue_running = true;
+	TRY_CATCH (e, EXCEPTION_ALL) {
+#ifdef PLATFORM_HAS_SWD_TRANSFER
+		adiv5_swdp_queue_batch(dp);
+#else
+		adiv5_dp_queue_run(dp);
+#endif
+	}
+	swdp_queue_running = false;
+	swdptap_seq_out(0, 8);
+
+	if (e.type)
+		raise_exception(e.type, e.msg);
+}
+
 static void adiv5_swdp_abort(ADIv5_DP_t *dp, uint32_t abort)
 {
 	adiv5_dp_write(dp, ADIV5_DP_ABORT, abort);
@@ -49,11 +49,13 @@ const struct command_s cortexm_cmd_list[] = {
 
 static void cortexm_regs_read(target *t, void *data);
 static void cortexm_regs_write(target *t, const void *data);
+static int cortexm_reg_read(target *t, int reg, void *data, size_t max);
+static int cortexm_reg_write(target *t, int reg, const void *data, size_t len);
+static void cortexm_regs_flush(target *t);
 static uint32_t cortexm_pc_read(target *t);
 
 static void cortexm_reset(target *t);
 static enum target_halt_reason cortexm_halt_poll(target *t, target_addr *watch);
-static void cortexm_halt_request(target *t);
 static int cortexm_fault_unwind(target *t);
 
 static int cortexm_breakwatch_set(target *t, struct breakwatch *);
@@ -65,10 +67,17 @@ static target_addr cortexm_check_watch(target *t);
 
 static int cortexm_hostio_request(target *t);
 
+/* Entries in regnum_cortex_m and regnum_cortex_mf together */
+#define CORTEXM_MAX_REGS	(20 + 33)
+
 struct cortexm_priv {
 	ADIv5_AP_t *ap;
 	bool stepping;
 	bool on_bkpt;
+	/* Core registers cached while halted, in regs_read() order */
+	uint32_t regs[CORTEXM_MAX_REGS];
+	bool regs_valid;
+	uint64_t regs_dirty;
 	/* Watchpoint unit status */
 	bool hw_watchpoint[CORTEXM_MAX_WATCHPOINTS];
 	unsigned flash_patch_revision;
@@ -195,7 +204,7 @@ static bool cortexm_check_error(target *t)
 	return adiv5_dp_error(ap->dp) != 0;
 }
 
-static void cortexm_priv_free(void *priv)
+void cortexm_priv_free(void *priv)
 {
 	adiv5_ap_unref(((struct cortexm_priv *)priv)->ap);
 	free(priv);
@@ -215,6 +224,7 @@ bool cortexm_probe(ADIv5_AP_t *ap)
 	t->check_error = cortexm_check_error;
 	t->mem_read = cortexm_mem_read;
 	t->mem_write = cortexm_mem_write;
+	t->mem_crc32 = cortexm_mem_crc32;
 
 	t->driver = cortexm_driver_str;
 
@@ -225,6 +235,8 @@ bool cortexm_probe(ADIv5_AP_t *ap)
 	t->tdesc = tdesc_cortex_m;
 	t->regs_read = cortexm_regs_read;
 	t->regs_write = cortexm_regs_write;
+	t->reg_read = cortexm_reg_read;
+	t->reg_write = cortexm_reg_write;
 
 	t->reset = cortexm_reset;
 	t->halt_request = cortexm_halt_request;
@@ -285,6 +297,9 @@ bool cortexm_attach(target *t)
 	/* Clear any pending fault condition */
 	target_check_error(t);
 
+	/* Registers may have changed since we last saw the core halted */
+	priv->regs_valid = false;
+
 	target_halt_request(t);
 	tries = 10;
 	while(!platform_srst_get_val() && !target_halt_poll(t, NULL) && --tries)
@@ -343,98 +358,205 @@ void cortexm_detach(target *t)
 	for(i = 0; i < priv->hw_watchpoint_max; i++)
 		target_mem_write32(t, CORTEXM_DWT_FUNC(i), 0);
 
-	/* Disable debug */
+	/* Write back any register changes and disable debug */
+	cortexm_regs_flush(t);
+	priv->regs_valid = false;
 	target_mem_write32(t, CORTEXM_DHCSR, CORTEXM_DHCSR_DBGKEY);
 }
 
 enum { DB_DHCSR, DB_DCRSR, DB_DCRDR, DB_DEMCR };
 
-static void cortexm_regs_read(target *t, void *data)
+/* The core registers are read in one batch the first time they are
+ * needed after a halt and served from priv->regs until the core runs
+ * again.  Writes only update the cache and mark the register dirty,
+ * cortexm_regs_flush() sends the dirty ones before resuming. */
+static uint32_t cortexm_regnum(unsigned i)
 {
-	ADIv5_AP_t *ap = cortexm_ap(t);
-	uint32_t *regs = data;
+	if (i < sizeof(regnum_cortex_m) / 4)
+		return regnum_cortex_m[i];
+	return regnum_cortex_mf[i - sizeof(regnum_cortex_m) / 4];
+}
+
+static void cortexm_regs_fetch(target *t)
+{
+	struct cortexm_priv *priv = t->priv;
+	ADIv5_AP_t *ap = priv->ap;
+	uint32_t *regs = priv->regs;
 	unsigned i;
 
+	if (priv->regs_valid)
+		return;
+
 	/* FIXME: Describe what's really going on here */
 	adiv5_ap_write(ap, ADIV5_AP_CSW, ap->csw | ADIV5_AP_CSW_SIZE_WORD);
 
 	/* Map the banked data registers (0x10-0x1c) to the
 	 * debug registers DHCSR, DCRSR, DCRDR and DEMCR respectively */
-	adiv5_dp_low_access(ap->dp, ADIV5_LOW_WRITE, ADIV5_AP_TAR, CORTEXM_DHCSR);
-
-	/* Walk the regnum_cortex_m array, reading the registers it
-	 * calls out. */
-	adiv5_ap_write(ap, ADIV5_AP_DB(DB_DCRSR), regnum_cortex_m[0]); /* Required to switch banks */
-	*regs++ = adiv5_dp_read(ap->dp, ADIV5_AP_DB(DB_DCRDR));
-	for(i = 1; i < sizeof(regnum_cortex_m) / 4; i++) {
-		adiv5_dp_low_access(ap->dp, ADIV5_LOW_WRITE, ADIV5_AP_DB(DB_DCRSR),
-		                    regnum_cortex_m[i]);
-		*regs++ = adiv5_dp_read(ap->dp, ADIV5_AP_DB(DB_DCRDR));
+	adiv5_ap_write(ap, ADIV5_AP_TAR, CORTEXM_DHCSR);
+
+	/* Walk the register numbers, reading the registers they call
+	 * out.  The reads are queued and collected in one go. */
+	adiv5_ap_write(ap, ADIV5_AP_DB(DB_DCRSR), cortexm_regnum(0)); /* Required to switch banks */
+	adiv5_dp_queue_read(ap->dp, ADIV5_AP_DB(DB_DCRDR), regs++);
+	for(i = 1; i < t->regs_size / 4; i++) {
+		adiv5_dp_queue_write(ap->dp, ADIV5_AP_DB(DB_DCRSR),
+		                     cortexm_regnum(i));
+		adiv5_dp_queue_read(ap->dp, ADIV5_AP_DB(DB_DCRDR), regs++);
 	}
-	if (t->target_options & TOPT_FLAVOUR_V7MF)
-		for(i = 0; i < sizeof(regnum_cortex_mf) / 4; i++) {
-			adiv5_dp_low_access(ap->dp, ADIV5_LOW_WRITE,
-			                    ADIV5_AP_DB(DB_DCRSR),
-			                    regnum_cortex_mf[i]);
-			*regs++ = adiv5_dp_read(ap->dp, ADIV5_AP_DB(DB_DCRDR));
-		}
+	adiv5_dp_queue_flush(ap->dp);
+
+	/* Don't keep what a failed transfer left behind */
+	priv->regs_valid = !ap->dp->fault;
+	priv->regs_dirty = 0;
+}
+
+static void cortexm_regs_flush(target *t)
+{
+	struct cortexm_priv *priv = t->priv;
+	ADIv5_AP_t *ap = priv->ap;
+	bool first = true;
+	unsigned i;
+
+	if (!priv->regs_dirty)
+		return;
+
+	adiv5_ap_write(ap, ADIV5_AP_CSW, ap->csw | ADIV5_AP_CSW_SIZE_WORD);
+	adiv5_ap_write(ap, ADIV5_AP_TAR, CORTEXM_DHCSR);
+
+	for(i = 0; i < t->regs_size / 4; i++) {
+		if (!(priv->regs_dirty & (1ULL << i)))
+			continue;
+		if (first) /* Required to switch banks */
+			adiv5_ap_write(ap, ADIV5_AP_DB(DB_DCRDR), priv->regs[i]);
+		else
+			adiv5_dp_queue_write(ap->dp, ADIV5_AP_DB(DB_DCRDR),
+			                     priv->regs[i]);
+		adiv5_dp_queue_write(ap->dp, ADIV5_AP_DB(DB_DCRSR),
+		                     0x10000 | cortexm_regnum(i));
+		first = false;
+	}
+	adiv5_dp_queue_flush(ap->dp);
+	priv->regs_dirty = 0;
+}
+
+static void cortexm_regs_read(target *t, void *data)
+{
+	struct cortexm_priv *priv = t->priv;
+
+	cortexm_regs_fetch(t);
+	memcpy(data, priv->regs, t->regs_size);
 }
 
 static void cortexm_regs_write(target *t, const void *data)
 {
-	ADIv5_AP_t *ap = cortexm_ap(t);
+	struct cortexm_priv *priv = t->priv;
 	const uint32_t *regs = data;
 	unsigned i;
 
-	/* FIXME: Describe what's really going on here */
-	adiv5_ap_write(ap, ADIV5_AP_CSW, ap->csw | ADIV5_AP_CSW_SIZE_WORD);
+	/* A full write needs no fetch, only mark what really changed */
+	for(i = 0; i < t->regs_size / 4; i++) {
+		if (priv->regs_valid && (priv->regs[i] == regs[i]))
+			continue;
+		priv->regs[i] = regs[i];
+		priv->regs_dirty |= 1ULL << i;
+	}
+	priv->regs_valid = true;
+}
 
-	/* Map the banked data registers (0x10-0x1c) to the
-	 * debug registers DHCSR, DCRSR, DCRDR and DEMCR respectively */
-	adiv5_dp_low_access(ap->dp, ADIV5_LOW_WRITE, ADIV5_AP_TAR, CORTEXM_DHCSR);
-
-	/* Walk the regnum_cortex_m array, writing the registers it
-	 * calls out. */
-	adiv5_ap_write(ap, ADIV5_AP_DB(DB_DCRDR), *regs++); /* Required to switch banks */
-	adiv5_dp_low_access(ap->dp, ADIV5_LOW_WRITE, ADIV5_AP_DB(DB_DCRSR),
-	                    0x10000 | regnum_cortex_m[0]);
-	for(i = 1; i < sizeof(regnum_cortex_m) / 4; i++) {
-		adiv5_dp_low_access(ap->dp, ADIV5_LOW_WRITE,
-		                    ADIV5_AP_DB(DB_DCRDR), *regs++);
-		adiv5_dp_low_access(ap->dp, ADIV5_LOW_WRITE, ADIV5_AP_DB(DB_DCRSR),
-		                    0x10000 | regnum_cortex_m[i]);
+/* Map a GDB register number to the cache, the FP double registers
+ * each take two single register slots. */
+static int cortexm_reg_map(target *t, int reg, size_t *size)
+{
+	const int nregs = sizeof(regnum_cortex_m) / 4;
+
+	*size = 4;
+	if ((reg >= 0) && (reg < nregs))
+		return reg;
+	if (!(t->target_options & TOPT_FLAVOUR_V7MF))
+		return -1;
+	if (reg == nregs)	/* fpscr */
+		return reg;
+	if ((reg > nregs) && (reg <= nregs + 16)) {	/* d0-d15 */
+		*size = 8;
+		return nregs + 1 + (reg - nregs - 1) * 2;
 	}
-	if (t->target_options & TOPT_FLAVOUR_V7MF)
-		for(i = 0; i < sizeof(regnum_cortex_mf) / 4; i++) {
-			adiv5_dp_low_access(ap->dp, ADIV5_LOW_WRITE,
-			                    ADIV5_AP_DB(DB_DCRDR), *regs++);
-			adiv5_dp_low_access(ap->dp, ADIV5_LOW_WRITE,
-			                    ADIV5_AP_DB(DB_DCRSR),
-			                    0x10000 | regnum_cortex_mf[i]);
-		}
+	return -1;
 }
 
-static uint32_t cortexm_pc_read(target *t)
+/* A lone register is read directly rather than fetching the whole file,
+ * the range step loop only looks at the PC after each step.  Nothing is
+ * dirty while the cache is invalid. */
+static uint32_t cortexm_reg_read_one(target *t, unsigned i)
 {
-	target_mem_write32(t, CORTEXM_DCRSR, 0x0F);
+	struct cortexm_priv *priv = t->priv;
+
+	if (priv->regs_valid)
+		return priv->regs[i];
+	target_mem_write32(t, CORTEXM_DCRSR, cortexm_regnum(i));
 	return target_mem_read32(t, CORTEXM_DCRDR);
 }
 
+static int cortexm_reg_read(target *t, int reg, void *data, size_t max)
+{
+	struct cortexm_priv *priv = t->priv;
+	size_t size;
+	int i = cortexm_reg_map(t, reg, &size);
+
+	if ((i < 0) || (size > max))
+		return -1;
+	if (size == 4) {
+		uint32_t val = cortexm_reg_read_one(t, i);
+		memcpy(data, &val, size);
+		return size;
+	}
+	cortexm_regs_fetch(t);
+	memcpy(data, &priv->regs[i], size);
+	return size;
+}
+
+static int cortexm_reg_write(target *t, int reg, const void *data, size_t len)
+{
+	struct cortexm_priv *priv = t->priv;
+	size_t size;
+	int i = cortexm_reg_map(t, reg, &size);
+
+	if ((i < 0) || (len != size))
+		return -1;
+	cortexm_regs_fetch(t);
+	memcpy(&priv->regs[i], data, size);
+	priv->regs_dirty |= ((size == 8) ? 3ULL : 1ULL) << i;
+	return size;
+}
+
+static uint32_t cortexm_pc_read(target *t)
+{
+	return cortexm_reg_read_one(t, REG_PC);
+}
+
 static void cortexm_pc_write(target *t, const uint32_t val)
 {
-	target_mem_write32(t, CORTEXM_DCRDR, val);
-	target_mem_write32(t, CORTEXM_DCRSR, CORTEXM_DCRSR_REGWnR | 0x0F);
+	struct cortexm_priv *priv = t->priv;
+
+	cortexm_regs_fetch(t);
+	priv->regs[REG_PC] = val;
+	priv->regs_dirty |= 1ULL << REG_PC;
 }
 
 /* The following three routines implement target halt/resume
  * using the core debug registers in the NVIC. */
 static void cortexm_reset(target *t)
 {
+	struct cortexm_priv *priv = t->priv;
+
 	if ((t->target_options & CORTEXM_TOPT_INHIBIT_SRST) == 0) {
 		platform_srst_set_val(true);
 		platform_srst_set_val(false);
 	}
 
+	/* Anything cached or pending is lost with the reset */
+	priv->regs_valid = false;
+	priv->regs_dirty = 0;
+
 	/* Read DHCSR here to clear S_RESET_ST bit before reset */
 	target_mem_read32(t, CORTEXM_DHCSR);
 
@@ -457,7 +579,7 @@ static void cortexm_reset(target *t)
 	target_mem_write32(t, CORTEXM_DFSR, CORTEXM_DFSR_RESETALL);
 }
 
-static void cortexm_halt_request(target *t)
+void cortexm_halt_request(target *t)
 {
 	volatile struct exception e;
 	TRY_CATCH (e, EXCEPTION_TIMEOUT) {
@@ -553,6 +675,8 @@ void cortexm_halt_resume(target *t, bool step)
 			cortexm_pc_write(t, pc + 2);
 	}
 
+	cortexm_regs_flush(t);
+	priv->regs_valid = false;
 	target_mem_write32(t, CORTEXM_DHCSR, dhcsr);
 }
 
@@ -617,6 +741,17 @@ static int cortexm_fault_unwind(target *t)
 
 int cortexm_run_stub(target *t, uint32_t loadaddr,
                      uint32_t r0, uint32_t r1, uint32_t r2, uint32_t r3)
+{
+	int ret = cortexm_start_stub(t, loadaddr, r0, r1, r2, r3);
+	if (ret)
+		return ret;
+	return cortexm_wait_stub(t, true);
+}
+
+/* Start a stub without waiting for it, so the debugger can keep feeding
+ * it through target memory.  cortexm_wait_stub() collects the result. */
+int cortexm_start_stub(target *t, uint32_t loadaddr,
+                       uint32_t r0, uint32_t r1, uint32_t r2, uint32_t r3)
 {
 	uint32_t regs[t->regs_size / 4];
 
@@ -635,10 +770,18 @@ int cortexm_run_stub(target *t, uint32_t loadaddr,
 		return -1;
 
 	/* Execute the stub */
-	enum target_halt_reason reason;
 	cortexm_halt_resume(t, 0);
+	return 0;
+}
+
+/* Return the exit code of a stub, or CORTEXM_STUB_RUNNING if it hasn't
+ * finished and block is false. */
+int cortexm_wait_stub(target *t, bool block)
+{
+	enum target_halt_reason reason;
 	while ((reason = cortexm_halt_poll(t, NULL)) == TARGET_HALT_RUNNING)
-		;
+		if (!block)
+			return CORTEXM_STUB_RUNNING;
 
 	if (reason == TARGET_HALT_ERROR)
 		raise_exception(EXCEPTION_ERROR, "Target lost in stub");
@@ -654,6 +797,94 @@ int cortexm_run_stub(target *t, uint32_t loadaddr,
 	return bkpt_instr & 0xff;
 }
 
+/* Checksumming less than this isn't worth loading a stub for */
+#define CORTEXM_CRC32_MIN_LEN	4096
+
+static const uint16_t cortexm_crc32_stub_code[] = {
+#include "flashstub/crc32.stub"
+};
+
+/* Run a CRC-32 stub over target memory, leaving the core and the RAM
+ * it borrows as they were.  The stub gets r0 = base, r1 = len and
+ * r2 = scratch bytes of RAM following it, and leaves the CRC in r0.
+ * Returns false if the stub can't be run, the caller should then
+ * compute the CRC itself. */
+bool cortexm_crc32_stub(target *t, const uint16_t *stub, size_t stub_size,
+                        size_t scratch, target_addr base, size_t len,
+                        uint32_t *crc)
+{
+	struct cortexm_priv *priv = t->priv;
+	size_t code_size = ALIGN(stub_size, 4);
+	size_t ram_size = code_size + scratch;
+	struct target_ram *r;
+	uint32_t saved_regs[t->regs_size / 4];
+	uint32_t regs[t->regs_size / 4];
+	bool saved_on_bkpt = priv->on_bkpt;
+	bool ok;
+
+	if (len < CORTEXM_CRC32_MIN_LEN)
+		return false;
+	if (!(target_mem_read32(t, CORTEXM_DHCSR) & CORTEXM_DHCSR_S_HALT))
+		return false;
+
+	/* The stub must not overwrite the range it is checksumming */
+	for (r = t->ram; r; r = r->next)
+		if ((r->length >= ram_size) &&
+		    ((base >= r->start + ram_size) || (base + len <= r->start)))
+			break;
+	if (!r)
+		return false;
+
+	uint8_t *saved_ram = malloc(ram_size);
+	if (!saved_ram)
+		return false;
+
+	cortexm_regs_read(t, saved_regs);
+	target_mem_read(t, saved_ram, r->start, ram_size);
+	if (target_check_error(t)) {
+		free(saved_ram);
+		return false;
+	}
+
+	target_mem_write(t, r->start, stub, stub_size);
+
+	memcpy(regs, saved_regs, sizeof(regs));
+	regs[0] = base;
+	regs[1] = len;
+	regs[2] = r->start + code_size;
+	regs[REG_SP] = r->start + r->length;
+	regs[REG_PC] = r->start;
+	regs[REG_XPSR] = 0x1000000;
+	regs[REG_MSP] = r->start + r->length;
+	regs[REG_SPECIAL] = 1;	/* PRIMASK, keep interrupts out of the way */
+	cortexm_regs_write(t, regs);
+
+	ok = !target_check_error(t);
+	if (ok) {
+		cortexm_halt_resume(t, 0);
+		ok = cortexm_wait_stub(t, true) == 0;
+	}
+	if (ok) {
+		cortexm_regs_read(t, regs);
+		*crc = regs[0];
+	}
+
+	target_mem_write(t, r->start, saved_ram, ram_size);
+	cortexm_regs_write(t, saved_regs);
+	priv->on_bkpt = saved_on_bkpt;
+	free(saved_ram);
+
+	return !target_check_error(t) && ok;
+}
+
+bool cortexm_mem_crc32(target *t, target_addr base, size_t len, uint32_t *crc)
+{
+	/* Room for the lookup table */
+	return cortexm_crc32_stub(t, cortexm_crc32_stub_code,
+	                          sizeof(cortexm_crc32_stub_code), 256 * 4,
+	                          base, len, crc);
+}
+
 /* The following routines implement hardware breakpoints and watchpoints.
  * The Flash Patch and Breakpoint (FPB) and Data Watch and Trace (DWT)
  * systems are used. */
@@ -158,12 +158,22 @@
 
 bool cortexm_probe(ADIv5_AP_t *ap);
 ADIv5_AP_t *cortexm_ap(target *t);
+void cortexm_priv_free(void *priv);
 
 bool cortexm_attach(target *t);
 void cortexm_detach(target *t);
+void cortexm_halt_request(target *t);
 void cortexm_halt_resume(target *t, bool step);
 int cortexm_run_stub(target *t, uint32_t loadaddr,
                      uint32_t r0, uint32_t r1, uint32_t r2, uint32_t r3);
+#define CORTEXM_STUB_RUNNING	-3
+int cortexm_start_stub(target *t, uint32_t loadaddr,
+                       uint32_t r0, uint32_t r1, uint32_t r2, uint32_t r3);
+int cortexm_wait_stub(target *t, bool block);
+bool cortexm_crc32_stub(target *t, const uint16_t *stub, size_t stub_size,
+                        size_t scratch, target_addr base, size_t len,
+                        uint32_t *crc);
+bool cortexm_mem_crc32(target *t, target_addr base, size_t len, uint32_t *crc);
 
 #endif
 
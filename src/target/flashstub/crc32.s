@@ -17,25 +17,53 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
-#include "libopencm3/stm32/flash.h"
-#include "stub.h"
 
-#define SR_ERROR_MASK 0xF2
-
-void __attribute__((naked))
-stm32f4_flash_write_x32_stub(uint32_t *dest, uint32_t *src, uint32_t size)
-{
-	for (int i = 0; i < size; i += 4) {
-		FLASH_CR = FLASH_CR_PROGRAM_X32 | FLASH_CR_PG;
-		*dest++ = *src++;
-		__asm("dsb");
-		while (FLASH_SR & FLASH_SR_BSY)
-			;
-	}
-
-	if (FLASH_SR & SR_ERROR_MASK)
-		stub_exit(1);
-
-	stub_exit(0);
-}
+/* CRC-32 as used by GDB's qCRC: MSB first, polynomial 0x04C11DB7,
+ * initial value 0xFFFFFFFF and no final XOR.
+ *
+ * r0 = data, r1 = len, r2 = scratch RAM for the 256 word lookup table,
+ * which is built first.  The CRC is left in r0 before the bkpt 0.
+ */
 
+	.syntax unified
+	.thumb
+	.text
+	/* r0 = data, r1 = len, r2 = table[256] */
+	movs r3, #0
+	ldr r7, poly
+gen:
+	lsls r4, r3, #24
+	movs r5, #8
+bit:
+	lsls r4, r4, #1
+	bcc 1f
+	eors r4, r7
+1:
+	subs r5, #1
+	bne bit
+	lsls r6, r3, #2
+	str r4, [r2, r6]
+	adds r3, #1
+	lsrs r6, r3, #8
+	beq gen
+	movs r3, #0
+	mvns r3, r3
+	cmp r1, #0
+	beq done
+byte:
+	ldrb r4, [r0]
+	adds r0, #1
+	lsrs r5, r3, #24
+	eors r5, r4
+	lsls r5, r5, #2
+	ldr r5, [r2, r5]
+	lsls r3, r3, #8
+	eors r3, r5
+	subs r1, #1
+	bne byte
+done:
+	movs r0, r3
+	bkpt 0
+	.p2align 2
+poly:
+	.word 0x04C11DB7
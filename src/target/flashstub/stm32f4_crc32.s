@@ -0,0 +1,82 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * Copyright (C) 2015  Black Sphere Technologies Ltd.
+ * Written by Gareth McMullin <gareth@blacksphere.co.nz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Same CRC-32 as crc32.s, feeding whole words to the STM32F2/F4/F7 CRC
+ * unit and finishing the last 0-3 bytes bitwise.  The CRC unit clock
+ * is switched on for the run and put back as it was.
+ *
+ * r0 = data, r1 = len.  The CRC is left in r0 before the bkpt 0.
+ */
+
+	.syntax unified
+	.thumb
+	.text
+	/* r0 = data, r1 = len */
+	ldr r2, rcc_ahb1enr
+	ldr r6, [r2]
+	ldr r3, crcen
+	orrs r3, r6
+	str r3, [r2]
+	ldr r3, [r2]
+	ldr r3, crc_base
+	movs r4, #1
+	str r4, [r3, #8]
+words:
+	cmp r1, #4
+	blo tail
+	ldr r4, [r0]
+	rev r4, r4
+	str r4, [r3]
+	adds r0, #4
+	subs r1, #4
+	b words
+tail:
+	ldr r4, [r3]
+	str r6, [r2]
+	ldr r7, poly
+bytes:
+	cmp r1, #0
+	beq done
+	ldrb r5, [r0]
+	adds r0, #1
+	lsls r5, r5, #24
+	eors r4, r5
+	movs r5, #8
+bit:
+	lsls r4, r4, #1
+	bcc 1f
+	eors r4, r7
+1:
+	subs r5, #1
+	bne bit
+	subs r1, #1
+	b bytes
+done:
+	movs r0, r4
+	bkpt 0
+	.p2align 2
+rcc_ahb1enr:
+	.word 0x40023830
+crcen:
+	.word 0x00001000
+crc_base:
+	.word 0x40023000
+poly:
+	.word 0x04C11DB7
@@ -0,0 +1,74 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * Copyright (C) 2015  Black Sphere Technologies Ltd.
+ * Written by Gareth McMullin <gareth@blacksphere.co.nz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Resident STM32F4 programming stub, word parallelism (x32).
+ *
+ * Same job queue and exits as stm32f4_x8.s, but programs a word at a
+ * time, so sizes must be multiples of 4.
+ */
+
+	.syntax unified
+	.thumb
+	.text
+	/* r0 = job[2] = {dest, src, size} */
+	ldr r5, lit_sr
+	ldr r6, lit_cr
+	movs r1, #0
+next:
+	adds r7, r0, r1
+wait:
+	ldr r4, [r7, #8]
+	cmp r4, #0
+	beq wait
+	adds r2, r4, #1
+	beq stop
+	ldr r2, [r7, #0]
+	ldr r3, [r7, #4]
+prog:
+	str r6, [r5, #4]
+	ldr r7, [r3]
+	str r7, [r2]
+	dsb sy
+busy:
+	ldr r7, [r5]
+	lsls r7, r7, #15
+	bmi busy
+	adds r3, r3, #4
+	adds r2, r2, #4
+	subs r4, r4, #4
+	bhi prog
+	ldr r7, [r5]
+	movs r3, #0xF2
+	tst r7, r3
+	bne error
+	adds r7, r0, r1
+	str r4, [r7, #8]
+	movs r7, #12
+	eors r1, r7
+	b next
+error:
+	bkpt 1
+stop:
+	bkpt 0
+	.p2align 2
+lit_sr:
+	.word 0x40023C0C
+lit_cr:
+	.word 0x201
@@ -0,0 +1,82 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * Copyright (C) 2017  Black Sphere Technologies Ltd.
+ * Written by Gordon Smith <gordonhj.smith@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Resident STM32F4 programming stub, byte parallelism (x8).
+ *
+ * r0 points at two jobs shared with the debugger, see
+ * stm32f4_flash_write():
+ *	struct { uint8_t *dest; uint8_t *src; volatile uint32_t size; } job[2];
+ * The jobs are used in turn.  The debugger fills the buffer at src and
+ * then sets size, the stub programs it and clears size to hand it back.
+ * A size of 0xFFFFFFFF ends the stub with bkpt 0, a flash error in
+ * FLASH_SR (mask 0xF2) with bkpt 1.
+ *
+ * Registers: r0 job, r1 offset of the current job (0 or 12), r2 dest,
+ * r3 src, r4 bytes left, r5 FLASH_SR, r6 FLASH_CR value.
+ */
+
+	.syntax unified
+	.thumb
+	.text
+	/* r0 = job[2] = {dest, src, size} */
+	ldr r5, lit_sr
+	ldr r6, lit_cr
+	movs r1, #0
+next:
+	adds r7, r0, r1
+wait:
+	ldr r4, [r7, #8]
+	cmp r4, #0
+	beq wait
+	adds r2, r4, #1
+	beq stop
+	ldr r2, [r7, #0]
+	ldr r3, [r7, #4]
+prog:
+	str r6, [r5, #4]
+	ldrb r7, [r3]
+	strb r7, [r2]
+	dsb sy
+busy:
+	ldr r7, [r5]
+	lsls r7, r7, #15
+	bmi busy
+	adds r3, r3, #1
+	adds r2, r2, #1
+	subs r4, r4, #1
+	bhi prog
+	ldr r7, [r5]
+	movs r3, #0xF2
+	tst r7, r3
+	bne error
+	adds r7, r0, r1
+	str r4, [r7, #8]
+	movs r7, #12
+	eors r1, r7
+	b next
+error:
+	bkpt 1
+stop:
+	bkpt 0
+	.p2align 2
+lit_sr:
+	.word 0x40023C0C
+lit_cr:
+	.word 0x001
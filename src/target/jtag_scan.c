@@ -70,8 +70,22 @@ static const struct jtag_dev_descr_s {
 	{.idcode = 0, .idmask = 0, .descr = "Unknown"},
 };
 
-/* bucket of ones for don't care TDI */
-static const uint8_t ones[] = "\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF";
+/* bucket of ones for don't care TDI, large enough for a whole scan */
+static const uint8_t ones[JTAG_MAX_DEVS * 4] = {
+	[0 ... JTAG_MAX_DEVS * 4 - 1] = 0xFF
+};
+
+/* Longest IR scan: every device at the maximum IR length followed by the
+ * two consecutive ones that mark the end of the chain. */
+#define IR_SCAN_BITS ((JTAG_MAX_DEVS + 1) * (JTAG_MAX_IR_LEN + 1) + 1)
+/* One BYPASS bit per device and the terminating one */
+#define BYPASS_SCAN_BITS (JTAG_MAX_DEVS + 3)
+#define IDCODE_SCAN_BITS (JTAG_MAX_DEVS * 32)
+
+static inline bool jtag_bit(const uint8_t *buf, int n)
+{
+	return (buf[n >> 3] >> (n & 7)) & 1;
+}
 
 /* Scan JTAG chain for devices, store IR length and IDCODE (if present).
  * Reset TAP state machine.
@@ -89,10 +103,19 @@ static const uint8_t ones[] = "\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF";
  * For each device, shift out one bit. If this is zero IDCODE isn't present,
  *	continue to next device. If this is one shift out the remaining 31 bits
  *	of the IDCODE register.
+ *
+ * None of the shifts depend on what was read before, so all three are
+ * issued with enough ones for the largest chain and the captured bits are
+ * only examined after a single jtagtap_sync().
  */
 int jtag_scan(const uint8_t *irlens)
 {
-	int i;
+	uint8_t irout[IR_SCAN_BITS / 8 + 1];
+	uint8_t bypass[BYPASS_SCAN_BITS / 8 + 1];
+	uint8_t idcode[IDCODE_SCAN_BITS / 8 + 1];
+	int ir_bits = IR_SCAN_BITS;
+	bool probe = !irlens;
+	int i, k;
 	uint32_t j;
 
 	target_list_free();
@@ -100,26 +123,13 @@ int jtag_scan(const uint8_t *irlens)
 	jtag_dev_count = 0;
 	memset(&jtag_devs, 0, sizeof(jtag_devs));
 
-	/* Run throught the SWD to JTAG sequence for the case where an attached SWJ-DP is
-	 * in SW-DP mode.
-	 */
-	DEBUG("Resetting TAP\n");
-	jtagtap_init();
-	jtagtap_reset();
-
-	if (irlens) {
+	if (!probe) {
 		DEBUG("Given list of IR lengths, skipping probe\n");
-		DEBUG("Change state to Shift-IR\n");
-		jtagtap_shift_ir();
 		j = 0;
-		while((jtag_dev_count <= JTAG_MAX_DEVS) &&
-		      (jtag_devs[jtag_dev_count].ir_len <= JTAG_MAX_IR_LEN)) {
-			uint32_t irout;
-			if(*irlens == 0)
-				break;
-			jtagtap_tdi_tdo_seq((uint8_t*)&irout, 0, ones, *irlens);
-			if (!(irout & 1)) {
-				DEBUG("check failed: IR[0] != 1\n");
+		while((jtag_dev_count <= JTAG_MAX_DEVS) && *irlens) {
+			if(j + *irlens > IR_SCAN_BITS) {
+				DEBUG("jtag_scan: Maximum IR length exceeded\n");
+				jtag_dev_count = -1;
 				return -1;
 			}
 			jtag_devs[jtag_dev_count].ir_len = *irlens;
@@ -129,20 +139,54 @@ int jtag_scan(const uint8_t *irlens)
 			irlens++;
 			jtag_dev_count++;
 		}
-	} else {
-		DEBUG("Change state to Shift-IR\n");
-		jtagtap_shift_ir();
+		ir_bits = j + 1;
+	}
 
-		DEBUG("Scanning out IRs\n");
-		if(!jtagtap_next(0, 1)) {
+	/* Run throught the SWD to JTAG sequence for the case where an attached SWJ-DP is
+	 * in SW-DP mode.
+	 */
+	DEBUG("Resetting TAP\n");
+	jtagtap_init();
+	jtagtap_reset();
+
+	DEBUG("Scanning out IRs\n");
+	jtagtap_shift_ir();
+	jtagtap_tdi_tdo_seq_deferred(irout, 1, ones, ir_bits);
+	jtagtap_return_idle();
+
+	/* All devices should be in BYPASS now */
+	DEBUG("Counting devices in BYPASS\n");
+	jtagtap_shift_dr();
+	jtagtap_tdi_tdo_seq_deferred(bypass, 1, ones, BYPASS_SCAN_BITS);
+	jtagtap_return_idle();
+
+	/* Reset jtagtap: should take all devs to IDCODE */
+	DEBUG("Reading IDCODEs\n");
+	jtagtap_reset();
+	jtagtap_shift_dr();
+	jtagtap_tdi_tdo_seq_deferred(idcode, 1, ones, IDCODE_SCAN_BITS);
+	jtagtap_return_idle();
+
+	jtagtap_sync();
+
+	if (jtag_dev_count) {
+		for(i = 0; i < jtag_dev_count; i++) {
+			if (!jtag_bit(irout, jtag_devs[i].ir_prescan)) {
+				DEBUG("check failed: IR[0] != 1\n");
+				return -1;
+			}
+		}
+	} else {
+		if(!jtag_bit(irout, 0)) {
 			DEBUG("jtag_scan: Sanity check failed: IR[0] shifted out as 0\n");
 			jtag_dev_count = -1;
 			return -1; /* must be 1 */
 		}
 		jtag_devs[0].ir_len = 1; j = 1;
 		while((jtag_dev_count <= JTAG_MAX_DEVS) &&
-		      (jtag_devs[jtag_dev_count].ir_len <= JTAG_MAX_IR_LEN)) {
-			if(jtagtap_next(0, 1)) {
+		      (jtag_devs[jtag_dev_count].ir_len <= JTAG_MAX_IR_LEN) &&
+		      (j < IR_SCAN_BITS)) {
+			if(jtag_bit(irout, j)) {
 				if(jtag_devs[jtag_dev_count].ir_len == 1) break;
 				jtag_devs[++jtag_dev_count].ir_len = 1;
 				jtag_devs[jtag_dev_count].ir_prescan = j;
@@ -155,23 +199,16 @@ int jtag_scan(const uint8_t *irlens)
 			jtag_dev_count = -1;
 			return -1;
 		}
-		if(jtag_devs[jtag_dev_count].ir_len > JTAG_MAX_IR_LEN) {
+		if((jtag_devs[jtag_dev_count].ir_len > JTAG_MAX_IR_LEN) ||
+		   (j == IR_SCAN_BITS)) {
 			DEBUG("jtag_scan: Maximum IR length exceeded\n");
 			jtag_dev_count = -1;
 			return -1;
 		}
 	}
 
-	DEBUG("Return to Run-Test/Idle\n");
-	jtagtap_next(1, 1);
-	jtagtap_return_idle();
-
-	/* All devices should be in BYPASS now */
-
 	/* Count device on chain */
-	DEBUG("Change state to Shift-DR\n");
-	jtagtap_shift_dr();
-	for(i = 0; (jtagtap_next(0, 1) == 0) && (i <= jtag_dev_count); i++)
+	for(i = 0; !jtag_bit(bypass, i) && (i <= jtag_dev_count); i++)
 		jtag_devs[i].dr_postscan = jtag_dev_count - i - 1;
 
 	if(i != jtag_dev_count) {
@@ -181,9 +218,6 @@ int jtag_scan(const uint8_t *irlens)
 		return -1;
 	}
 
-	DEBUG("Return to Run-Test/Idle\n");
-	jtagtap_next(1, 1);
-	jtagtap_return_idle();
 	if(!jtag_dev_count) {
 		return 0;
 	}
@@ -193,19 +227,13 @@ int jtag_scan(const uint8_t *irlens)
 		jtag_devs[i-1].ir_postscan = jtag_devs[i].ir_postscan +
 					jtag_devs[i].ir_len;
 
-	/* Reset jtagtap: should take all devs to IDCODE */
-	jtagtap_reset();
-	jtagtap_shift_dr();
-	for(i = 0; i < jtag_dev_count; i++) {
-		if(!jtagtap_next(0, 1)) continue;
+	for(i = 0, k = 0; i < jtag_dev_count; i++) {
+		if(!jtag_bit(idcode, k++)) continue;
 		jtag_devs[i].idcode = 1;
 		for(j = 2; j; j <<= 1)
-			if(jtagtap_next(0, 1)) jtag_devs[i].idcode |= j;
+			if(jtag_bit(idcode, k++)) jtag_devs[i].idcode |= j;
 
 	}
-	DEBUG("Return to Run-Test/Idle\n");
-	jtagtap_next(1, 1);
-	jtagtap_return_idle();
 
 	/* Check for known devices and handle accordingly */
 	for(i = 0; i < jtag_dev_count; i++)
@@ -238,15 +266,23 @@ void jtag_dev_write_ir(jtag_dev_t *d, uint32_t ir)
 	jtagtap_return_idle();
 }
 
-void jtag_dev_shift_dr(jtag_dev_t *d, uint8_t *dout, const uint8_t *din, int ticks)
+void jtag_dev_shift_dr_deferred(jtag_dev_t *d, uint8_t *dout,
+                                const uint8_t *din, int ticks)
 {
 	jtagtap_shift_dr();
 	jtagtap_tdi_seq(0, ones, d->dr_prescan);
 	if(dout)
-		jtagtap_tdi_tdo_seq((void*)dout, d->dr_postscan?0:1, (void*)din, ticks);
+		jtagtap_tdi_tdo_seq_deferred((void*)dout, d->dr_postscan?0:1, (void*)din, ticks);
 	else
 		jtagtap_tdi_seq(d->dr_postscan?0:1, (void*)din, ticks);
 	jtagtap_tdi_seq(1, ones, d->dr_postscan);
 	jtagtap_return_idle();
 }
 
+void jtag_dev_shift_dr(jtag_dev_t *d, uint8_t *dout, const uint8_t *din, int ticks)
+{
+	jtag_dev_shift_dr_deferred(d, dout, din, ticks);
+	if(dout)
+		jtagtap_sync();
+}
+
@@ -47,6 +47,9 @@ extern int jtag_dev_count;
 
 void jtag_dev_write_ir(jtag_dev_t *dev, uint32_t ir);
 void jtag_dev_shift_dr(jtag_dev_t *dev, uint8_t *dout, const uint8_t *din, int ticks);
+/* As above, but dout is only valid after jtagtap_sync() */
+void jtag_dev_shift_dr_deferred(jtag_dev_t *dev, uint8_t *dout,
+                                const uint8_t *din, int ticks);
 
 #endif
 
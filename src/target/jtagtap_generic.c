@@ -63,3 +63,13 @@ jtagtap_tdi_seq(const uint8_t final_tms, const uint8_t *DI, int ticks)
 	}
 }
 
+void __attribute__((weak))
+jtagtap_tdi_tdo_seq_deferred(uint8_t *DO, const uint8_t final_tms, const uint8_t *DI, int ticks)
+{
+	jtagtap_tdi_tdo_seq(DO, final_tms, DI, ticks);
+}
+
+void __attribute__((weak))
+jtagtap_sync(void)
+{
+}
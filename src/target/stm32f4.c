@@ -53,6 +53,13 @@ static int stm32f4_flash_erase(struct target_flash *f, target_addr addr,
 							   size_t len);
 static int stm32f4_flash_write(struct target_flash *f,
                                target_addr dest, const void *src, size_t len);
+static int stm32f4_flash_done(struct target_flash *f);
+static bool stm32f4_mem_crc32(target *t, target_addr base, size_t len,
+                              uint32_t *crc);
+static void stm32f4_detach(target *t);
+static void stm32f4_halt_request(target *t);
+static void stm32f4_halt_resume(target *t, bool step);
+static void stm32f4_priv_free(void *priv);
 
 /* Flash Program ad Erase Controller Register Map */
 #if !defined(EPUCK2_CHIBIOS)
@@ -115,6 +122,9 @@ static int stm32f4_flash_write(struct target_flash *f,
 #define DBG_WWDG_STOP	(1 << 11)
 #define DBG_IWDG_STOP	(1 << 12)
 
+#define F4_RCC_AHB1ENR		0x40023830
+#define F4_RCC_AHB1ENR_CRCEN	(1 << 12)
+
 /* This routine uses word access.  Only usable on target voltage >2.7V */
 static const uint16_t stm32f4_flash_write_x32_stub[] = {
 #include "flashstub/stm32f4_x32.stub"
@@ -125,9 +135,31 @@ static const uint16_t stm32f4_flash_write_x8_stub[] = {
 #include "flashstub/stm32f4_x8.stub"
 };
 
-#define STUB_BUFFER_BASE \
+/* CRC-32 of whole words with the CRC unit */
+static const uint16_t stm32f4_crc32_stub[] = {
+#include "flashstub/stm32f4_crc32.stub"
+};
+
+/* The stubs stay running from the first write of a session until
+ * stm32f4_flash_done(), programming from two RAM buffers in turn so the
+ * next buffer is uploaded while the previous one is programmed.  Each
+ * buffer has a job {dest, src, size} in target RAM, as described in
+ * flashstub/stm32f4_x32.s.  The stub clears size when it is done with a
+ * buffer and stops on a size of STUB_STOP. */
+#define STUB_JOBS \
 	ALIGN(SRAM_BASE + MAX(sizeof(stm32f4_flash_write_x8_stub), \
 			      sizeof(stm32f4_flash_write_x32_stub)), 4)
+#define STUB_JOB(n)		(STUB_JOBS + (n) * 12)
+#define STUB_JOB_SIZE(n)	(STUB_JOB(n) + 8)
+#define STUB_STOP		0xFFFFFFFF
+#define STUB_BUFFER_SIZE	0x2000
+#define STUB_BUFFER(n)		(STUB_JOB(2) + (n) * STUB_BUFFER_SIZE)
+
+static struct {
+	target *t;	/* Target running the stub, NULL if none */
+	unsigned next;	/* Buffer to fill next */
+	bool error;	/* Stopped on an error, reported by flash_done */
+} stm32f4_pipe;
 
 #define AXIM_BASE 0x8000000
 #define ITCM_BASE 0x0200000
@@ -167,6 +199,7 @@ static void stm32f4_add_flash(target *t,
 	f->blocksize = blocksize;
 	f->erase = stm32f4_flash_erase;
 	f->write = stm32f4_flash_write;
+	f->done = stm32f4_flash_done;
 	f->align = 4;
 	f->erased = 0xff;
 	sf->base_sector = base_sector;
@@ -254,6 +287,11 @@ bool stm32f4_probe(target *t)
 	}
 	target_mem_write32(t, DBGMCU_CR, DBG_STANDBY| DBG_STOP | DBG_SLEEP);
 	t->driver = designator;
+	t->mem_crc32 = stm32f4_mem_crc32;
+	t->detach = stm32f4_detach;
+	t->halt_request = stm32f4_halt_request;
+	t->halt_resume = stm32f4_halt_resume;
+	t->priv_free = stm32f4_priv_free;
 	target_add_commands(t, stm32f4_cmd_list, designator);
 	t->idcode = idcode;
 	bool use_dual_bank = false;
@@ -267,6 +305,8 @@ bool stm32f4_probe(target *t)
 			use_dual_bank =  !(optcr & FLASH_OPTCR_nDBANK);
 		}
 	} else {
+		/* CCM can't hold code, SRAM goes last so the CRC stub,
+		 * which takes the first RAM that fits, runs from there. */
 		if (has_ccmram)
 			target_add_ram(t, 0x10000000, 0x10000); /* 64 k CCM Ram*/
 		target_add_ram(t, 0x20000000, 0x10000);     /* 64 k RAM */
@@ -332,6 +372,91 @@ static void stm32f4_flash_unlock(target *t)
 	}
 }
 
+static int stm32f4_pipe_start(target *t, uint8_t psize)
+{
+	uint32_t jobs[6] = {0};
+
+	if (psize == 32)
+		target_mem_write(t, SRAM_BASE, stm32f4_flash_write_x32_stub,
+		                 sizeof(stm32f4_flash_write_x32_stub));
+	else
+		target_mem_write(t, SRAM_BASE, stm32f4_flash_write_x8_stub,
+		                 sizeof(stm32f4_flash_write_x8_stub));
+	target_mem_write(t, STUB_JOBS, jobs, sizeof(jobs));
+	if (cortexm_start_stub(t, SRAM_BASE, STUB_JOBS, 0, 0, 0))
+		return -1;
+
+	stm32f4_pipe.t = t;
+	stm32f4_pipe.next = 0;
+	return 0;
+}
+
+/* Wait for the stub to hand buffer n back */
+static int stm32f4_pipe_wait(target *t, unsigned n)
+{
+	while (target_mem_read32(t, STUB_JOB_SIZE(n))) {
+		if (target_check_error(t) ||
+		    (cortexm_wait_stub(t, false) != CORTEXM_STUB_RUNNING)) {
+			/* The stub stopped on a programming error */
+			DEBUG("stm32f4 flash write: stub stopped\n");
+			stm32f4_pipe.t = NULL;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Let the stub finish the queued buffers and exit */
+static int stm32f4_pipe_stop(target *t)
+{
+	int ret;
+
+	if (stm32f4_pipe.t != t)
+		return 0;
+
+	ret = stm32f4_pipe_wait(t, stm32f4_pipe.next);
+	if (!ret) {
+		target_mem_write32(t, STUB_JOB_SIZE(stm32f4_pipe.next),
+		                   STUB_STOP);
+		ret = cortexm_wait_stub(t, true);
+	}
+	stm32f4_pipe.t = NULL;
+	if (ret)
+		stm32f4_pipe.error = true;
+	return ret ? -1 : 0;
+}
+
+/* A load GDB gave up on leaves the stub running, finish it before the
+ * core is handed back to GDB or the application. */
+static void stm32f4_detach(target *t)
+{
+	stm32f4_pipe_stop(t);
+	stm32f4_pipe.error = false;
+	cortexm_detach(t);
+}
+
+static void stm32f4_halt_request(target *t)
+{
+	stm32f4_pipe_stop(t);
+	cortexm_halt_request(t);
+}
+
+static void stm32f4_halt_resume(target *t, bool step)
+{
+	stm32f4_pipe_stop(t);
+	cortexm_halt_resume(t, step);
+}
+
+/* The target list is being freed, a stub can't be stopped any more and
+ * no flash_done() is left to report an error to. */
+static void stm32f4_priv_free(void *priv)
+{
+	if (stm32f4_pipe.t && (stm32f4_pipe.t->priv == priv))
+		stm32f4_pipe.t = NULL;
+	stm32f4_pipe.error = false;
+	cortexm_priv_free(priv);
+}
+
 static int stm32f4_flash_erase(struct target_flash *f, target_addr addr,
 							   size_t len)
 {
@@ -340,6 +465,7 @@ static int stm32f4_flash_erase(struct target_flash *f, target_addr addr,
 	uint32_t sr;
 	/* No address translation is needed here, as we erase by sector number */
 	uint8_t sector = sf->base_sector + (addr - f->start)/f->blocksize;
+	stm32f4_pipe_stop(t);
 	stm32f4_flash_unlock(t);
 
 	while(len) {
@@ -379,16 +505,57 @@ static int stm32f4_flash_write(struct target_flash *f,
 		dest = AXIM_BASE + (dest - ITCM_BASE);
 	}
 
-	/* Write buffer to target ram call stub */
-	if (((struct stm32f4_flash *)f)->psize == 32)
-		target_mem_write(f->t, SRAM_BASE, stm32f4_flash_write_x32_stub,
-		                 sizeof(stm32f4_flash_write_x32_stub));
-	else
-		target_mem_write(f->t, SRAM_BASE, stm32f4_flash_write_x8_stub,
-		                 sizeof(stm32f4_flash_write_x8_stub));
-	target_mem_write(f->t, STUB_BUFFER_BASE, src, len);
-	return cortexm_run_stub(f->t, SRAM_BASE, dest,
-	                        STUB_BUFFER_BASE, len, 0);
+	target *t = f->t;
+	if ((stm32f4_pipe.t != t) &&
+	    stm32f4_pipe_start(t, ((struct stm32f4_flash *)f)->psize))
+		return -1;
+
+	while (len) {
+		unsigned n = stm32f4_pipe.next;
+		uint32_t chunk = MIN(len, STUB_BUFFER_SIZE);
+		uint32_t job[3] = {dest, STUB_BUFFER(n), chunk};
+
+		/* Fill buffer n while the stub programs the other one,
+		 * the job is written last with size as its final word. */
+		if (stm32f4_pipe_wait(t, n))
+			return -1;
+		target_mem_write(t, STUB_BUFFER(n), src, chunk);
+		target_mem_write(t, STUB_JOB(n), job, sizeof(job));
+		stm32f4_pipe.next = n ^ 1;
+
+		dest += chunk;
+		src += chunk;
+		len -= chunk;
+	}
+	return target_check_error(t) ? -1 : 0;
+}
+
+static int stm32f4_flash_done(struct target_flash *f)
+{
+	int ret = stm32f4_pipe_stop(f->t);
+
+	/* The pipeline may have been stopped early by an erase or a CRC */
+	if (stm32f4_pipe.error)
+		ret = -1;
+	stm32f4_pipe.error = false;
+	return ret;
+}
+
+static bool stm32f4_mem_crc32(target *t, target_addr base, size_t len,
+                              uint32_t *crc)
+{
+	/* The stub and the CRC run would share the RAM */
+	stm32f4_pipe_stop(t);
+
+	/* Leave the CRC unit alone if the application is using it, and
+	 * let the generic stub deal with unaligned ranges. */
+	if ((base & 3) ||
+	    (target_mem_read32(t, F4_RCC_AHB1ENR) & F4_RCC_AHB1ENR_CRCEN))
+		return cortexm_mem_crc32(t, base, len, crc);
+
+	return cortexm_crc32_stub(t, stm32f4_crc32_stub,
+	                          sizeof(stm32f4_crc32_stub), 0,
+	                          base, len, crc);
 }
 
 static bool stm32f4_cmd_erase_mass(target *t)
@@ -399,6 +566,7 @@ static bool stm32f4_cmd_erase_mass(target *t)
 	struct stm32f4_flash *sf = (struct stm32f4_flash *)f;
 
 	tc_printf(t, "Erasing flash... This may take a few seconds.  ");
+	stm32f4_pipe_stop(t);
 	stm32f4_flash_unlock(t);
 
 	/* Flash mass erase start instruction */
@@ -21,11 +21,17 @@
 #include "general.h"
 #include "target.h"
 #include "target_internal.h"
+#include "crc32.h"
 
 #include <stdarg.h>
 
 target *target_list = NULL;
 
+/* Defer flash erases and skip blocks whose content doesn't change.  Off
+ * by default, the blocks are staged in target RAM over the application's
+ * data. */
+bool target_flash_incremental = false;
+
 target *target_new(void)
 {
 	target *t = (void*)calloc(1, sizeof(*t));
@@ -76,6 +82,7 @@ void target_list_free(void)
 			void * next = target_list->flash->next;
 			if (target_list->flash->buf)
 				free(target_list->flash->buf);
+			free(target_list->flash->erase_map);
 			free(target_list->flash);
 			target_list->flash = next;
 		}
@@ -194,6 +201,64 @@ static struct target_flash *flash_for_addr(target *t, uint32_t addr)
 	return NULL;
 }
 
+/* Incremental flashing: an erase only marks the blocks in erase_map.
+ * Writes to a marked block are staged in target RAM, at the top of a RAM
+ * region that leaves FLASH_INC_STUB_ROOM bytes below it for the flash and
+ * CRC stubs, which load at the start of a region.  Once the block is
+ * complete it is only erased and programmed if the CRC of the staged copy
+ * differs from the one of the block in flash, both computed on the target
+ * where the driver has a mem_crc32 stub.  Marked blocks that never get
+ * written are erased at target_flash_done() unless they are blank.
+ * Flash with blocks too large to stage is erased right away.
+ */
+#define FLASH_INC_STUB_ROOM	0x8000
+
+static unsigned flash_block(struct target_flash *f, target_addr addr)
+{
+	return (addr - f->start) / f->blocksize;
+}
+
+static bool flash_block_marked(struct target_flash *f, target_addr addr)
+{
+	unsigned block = flash_block(f, addr);
+	return f->erase_map && (f->erase_map[block / 8] & (1 << (block % 8)));
+}
+
+static void flash_block_unmark(struct target_flash *f, target_addr addr)
+{
+	unsigned block = flash_block(f, addr);
+	f->erase_map[block / 8] &= ~(1 << (block % 8));
+}
+
+/* Find room to stage a block at the top of a RAM region */
+static bool flash_stage_find(struct target_flash *f)
+{
+	for (struct target_ram *r = f->t->ram; r; r = r->next) {
+		if (r->length >= FLASH_INC_STUB_ROOM + f->blocksize) {
+			f->inc_stage = r->start + r->length - f->blocksize;
+			return true;
+		}
+	}
+	return false;
+}
+
+static int flash_erase_deferred(struct target_flash *f,
+                                target_addr addr, size_t len)
+{
+	if (!f->erase_map) {
+		unsigned blocks = f->length / f->blocksize;
+		if (!flash_stage_find(f))
+			return f->erase(f, addr, len);
+		f->erase_map = calloc((blocks + 7) / 8, 1);
+		if (!f->erase_map)
+			return f->erase(f, addr, len);
+	}
+	for (unsigned i = flash_block(f, addr);
+	     i <= flash_block(f, addr + len - 1); i++)
+		f->erase_map[i / 8] |= 1 << (i % 8);
+	return 0;
+}
+
 int target_flash_erase(target *t, target_addr addr, size_t len)
 {
 	int ret = 0;
@@ -201,13 +266,147 @@ int target_flash_erase(target *t, target_addr addr, size_t len)
 		struct target_flash *f = flash_for_addr(t, addr);
 		size_t tmptarget = MIN(addr + len, f->start + f->length);
 		size_t tmplen = tmptarget - addr;
-		ret |= f->erase(f, addr, tmplen);
+		if (target_flash_incremental)
+			ret |= flash_erase_deferred(f, addr, tmplen);
+		else
+			ret |= f->erase(f, addr, tmplen);
 		addr += tmplen;
 		len -= tmplen;
 	}
 	return ret;
 }
 
+static int flash_write_aligned(struct target_flash *f,
+                               target_addr dest, const void *src, size_t len)
+{
+	int ret = 0;
+	if (f->align > 1) {
+		/* Only an unaligned head and tail need padding, the
+		 * aligned middle is written straight from src. */
+		uint32_t offset = dest % f->align;
+		size_t head = offset ? MIN(f->align - offset, len) : 0;
+		size_t mid = len - head - (len - head) % f->align;
+		size_t tail = len - head - mid;
+		uint8_t data[f->align];
+		if (head) {
+			memset(data, f->erased, sizeof(data));
+			memcpy(data + offset, src, head);
+			ret |= f->write(f, dest - offset, data, sizeof(data));
+		}
+		if (mid)
+			ret |= f->write(f, dest + head, src + head, mid);
+		if (tail) {
+			memset(data, f->erased, sizeof(data));
+			memcpy(data, src + head + mid, tail);
+			ret |= f->write(f, dest + head + mid, data, sizeof(data));
+		}
+	} else {
+		ret |= f->write(f, dest, src, len);
+	}
+	return ret;
+}
+
+/* Stage erased bytes up to offset end of the staged block */
+static int flash_stage_fill(struct target_flash *f, size_t end)
+{
+	uint8_t blank[64];
+	int ret = 0;
+
+	memset(blank, f->erased, sizeof(blank));
+	while (!ret && (f->inc_fill < end)) {
+		size_t n = MIN(sizeof(blank), end - f->inc_fill);
+		ret = target_mem_write(f->t, f->inc_stage + f->inc_fill,
+		                       blank, n);
+		f->inc_fill += n;
+	}
+	return ret;
+}
+
+/* Erase and program the staged block, unless flash already holds it */
+static int flash_commit_block(struct target_flash *f)
+{
+	target *t = f->t;
+	uint8_t chunk[256];
+	int ret;
+
+	if (!f->inc_staged)
+		return 0;
+
+	f->inc_staged = false;
+	flash_block_unmark(f, f->inc_addr);
+	ret = flash_stage_fill(f, f->blocksize);
+	if (ret)
+		return ret;
+	if (generic_crc32(t, f->inc_stage, f->blocksize) ==
+	    generic_crc32(t, f->inc_addr, f->blocksize)) {
+		DEBUG("Flash block 0x%08"PRIx32" unchanged\n", f->inc_addr);
+		return 0;
+	}
+
+	ret = f->erase(f, f->inc_addr, f->blocksize);
+	for (size_t i = 0; !ret && (i < f->blocksize); i += sizeof(chunk)) {
+		size_t n = MIN(sizeof(chunk), f->blocksize - i);
+		ret = target_mem_read(t, chunk, f->inc_stage + i, n);
+		if (!ret)
+			ret = flash_write_aligned(f, f->inc_addr + i, chunk, n);
+	}
+	return ret;
+}
+
+static int flash_write_incremental(struct target_flash *f,
+                                   target_addr dest, const void *src, size_t len)
+{
+	int ret = 0;
+	while (len) {
+		uint32_t offset = (dest - f->start) % f->blocksize;
+		target_addr base = dest - offset;
+		size_t sectlen = MIN(f->blocksize - offset, len);
+
+		if (f->inc_staged && (base != f->inc_addr))
+			ret |= flash_commit_block(f);
+		if (!f->inc_staged && flash_block_marked(f, base)) {
+			f->inc_staged = true;
+			f->inc_addr = base;
+			f->inc_fill = 0;
+		}
+
+		if (f->inc_staged) {
+			ret |= flash_stage_fill(f, offset);
+			ret |= target_mem_write(f->t, f->inc_stage + offset,
+			                        src, sectlen);
+			f->inc_fill = MAX(f->inc_fill, offset + sectlen);
+		} else {
+			ret |= flash_write_aligned(f, dest, src, sectlen);
+		}
+
+		dest += sectlen;
+		src += sectlen;
+		len -= sectlen;
+	}
+	return ret;
+}
+
+static int flash_done_incremental(struct target_flash *f)
+{
+	int ret = flash_commit_block(f);
+	uint32_t blank;
+
+	if (!f->erase_map)
+		return ret;
+
+	/* Erased but never written blocks only need erasing if not blank */
+	blank = crc32_fill(f->erased, f->blocksize);
+	for (target_addr addr = f->start; addr < f->start + f->length;
+	     addr += f->blocksize) {
+		if (flash_block_marked(f, addr) &&
+		    (generic_crc32(f->t, addr, f->blocksize) != blank))
+			ret |= f->erase(f, addr, f->blocksize);
+	}
+	free(f->erase_map);
+	f->erase_map = NULL;
+	return ret;
+}
+
 int target_flash_write(target *t,
                        target_addr dest, const void *src, size_t len)
 {
@@ -216,15 +415,10 @@ int target_flash_write(target *t,
 		struct target_flash *f = flash_for_addr(t, dest);
 		size_t tmptarget = MIN(dest + len, f->start + f->length);
 		size_t tmplen = tmptarget - dest;
-		if (f->align > 1) {
-			uint32_t offset = dest % f->align;
-			uint8_t data[ALIGN(offset + tmplen, f->align)];
-			memset(data, f->erased, sizeof(data));
-			memcpy((uint8_t *)data + offset, src, tmplen);
-			ret |= f->write(f, dest - offset, data, sizeof(data));
-		} else {
-			ret |= f->write(f, dest, src, tmplen);
-		}
+		if (f->erase_map)
+			ret |= flash_write_incremental(f, dest, src, tmplen);
+		else
+			ret |= flash_write_aligned(f, dest, src, tmplen);
 		dest += tmplen;
 		src += tmplen;
 		len -= tmplen;
@@ -235,11 +429,11 @@ int target_flash_write(target *t,
 int target_flash_done(target *t)
 {
 	for (struct target_flash *f = t->flash; f; f = f->next) {
-		if (f->done) {
-			int tmp = f->done(f);
-			if (tmp)
-				return tmp;
-		}
+		int tmp = flash_done_incremental(f);
+		if (!tmp && f->done)
+			tmp = f->done(f);
+		if (tmp)
+			return tmp;
 	}
 	return 0;
 }
@@ -314,10 +508,35 @@ int target_mem_write(target *t, target_addr dest, const void *src, size_t len)
 	return target_check_error(t);
 }
 
+/* Returns false if the target can't checksum this range itself, the
+ * caller then reads the memory back and does it on the probe. */
+bool target_mem_crc32(target *t, target_addr base, size_t len, uint32_t *crc)
+{
+	if (!t->mem_crc32)
+		return false;
+	return t->mem_crc32(t, base, len, crc);
+}
+
 /* Register access functions */
 void target_regs_read(target *t, void *data) { t->regs_read(t, data); }
 void target_regs_write(target *t, const void *data) { t->regs_write(t, data); }
 
+/* Single register access returns the register size, 0 if the target
+ * only supports the whole register file or -1 on error. */
+int target_reg_read(target *t, int reg, void *data, size_t max)
+{
+	if (!t->reg_read)
+		return 0;
+	return t->reg_read(t, reg, data, max);
+}
+
+int target_reg_write(target *t, int reg, const void *data, size_t len)
+{
+	if (!t->reg_write)
+		return 0;
+	return t->reg_write(t, reg, data, len);
+}
+
 /* Halt/resume functions */
 void target_reset(target *t) { t->reset(t); }
 void target_halt_request(target *t) { t->halt_request(t); }
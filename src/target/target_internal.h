@@ -52,6 +52,13 @@ struct target_flash {
 	flash_write_func write_buf;
 	target_addr buf_addr;
 	void *buf;
+
+	/* For incremental flashing */
+	uint8_t *erase_map;	/* Blocks with a deferred erase */
+	target_addr inc_stage;	/* Target RAM a block is staged in */
+	target_addr inc_addr;	/* Block being staged, if inc_staged */
+	size_t inc_fill;	/* Bytes of it staged so far */
+	bool inc_staged;
 };
 
 typedef bool (*cmd_handler)(target *t, int argc, const char **argv);
@@ -90,12 +97,18 @@ struct target_s {
 	                 size_t len);
 	void (*mem_write)(target *t, target_addr dest,
 	                  const void *src, size_t len);
+	/* Optional, checksum memory on the target itself */
+	bool (*mem_crc32)(target *t, target_addr base, size_t len,
+	                  uint32_t *crc);
 
 	/* Register access functions */
 	size_t regs_size;
 	const char *tdesc;
 	void (*regs_read)(target *t, void *data);
 	void (*regs_write)(target *t, const void *data);
+	/* Optional, access a single register by GDB register number */
+	int (*reg_read)(target *t, int reg, void *data, size_t max);
+	int (*reg_write)(target *t, int reg, const void *data, size_t len);
 
 	/* Halt/resume functions */
 	void (*reset)(target *t);